@@ -0,0 +1,176 @@
+#! /usr/bin/env python3
+"""Benchmarks pzip (or punzip) over a few corpora, thread counts and chunk
+sizes, printing one CSV row per configuration.
+
+Rows come out in a fixed order and carry the git revision, so two runs can be
+diffed:
+
+    ./bench.py > before.csv
+    ./bench.py > after.csv
+"""
+
+import argparse
+import csv
+import os
+import random
+import subprocess
+import sys
+import time
+
+MB = 1 << 20
+
+WORDS = ('the of and to in a is that for it as was with be by on not he i '
+         'this are or his from at which but have an they you were her she '
+         'there had all one will would their we him been has when who more '
+         'no if out so said what up its about into than them can only other '
+         'new some could time these two may then do first any my now such '
+         'like our over man me even most made after also did many before '
+         'must through back years where much your way well down should '
+         'because each just those people how too little state good very '
+         'make world still own see men work long get here between both life '
+         'being under never day same another know while last might us great '
+         'old year off come since against go came right used take three'
+         ).split()
+
+
+def gen_runs(rand, size):
+    """Long runs of a few chars, like sparse or padded data."""
+    out = bytearray()
+    while len(out) < size:
+        out += bytes([rand.choice(b'\0 \nab')]) * rand.randint(1000, 100000)
+    return out[:size]
+
+
+def gen_random(rand, size):
+    """Bytes with no runs to speak of."""
+    return bytearray(rand.randbytes(size))
+
+
+def gen_text(rand, size):
+    """English-like text, where almost every run is one char."""
+    out = bytearray()
+    while len(out) < size:
+        line = ' '.join(rand.choice(WORDS) for _ in range(rand.randint(4, 16)))
+        out += line.capitalize().encode() + b'.\n'
+    return out[:size]
+
+
+def gen_mixed(rand, size):
+    """Segments of the other corpora, so chunks differ in cost."""
+    out = bytearray()
+    gens = (gen_runs, gen_random, gen_text)
+    while len(out) < size:
+        out += rand.choice(gens)(rand, MB)
+    return out[:size]
+
+
+CORPORA = {
+    'runs': gen_runs,
+    'random': gen_random,
+    'text': gen_text,
+    'mixed': gen_mixed,
+}
+
+
+def corpus_path(args, name):
+    """Returns the corpus, generating it the first time it is asked for."""
+    path = os.path.join(args.dir, '%s-%dM.in' % (name, args.size))
+    if not os.path.exists(path):
+        os.makedirs(args.dir, exist_ok=True)
+        data = CORPORA[name](random.Random(name), args.size * MB)
+        with open(path + '.tmp', 'wb') as f:
+            f.write(data)
+        os.rename(path + '.tmp', path)
+    if args.tool == 'punzip':
+        compressed = '%s.%s.z' % (path, output_format())
+        if not os.path.exists(compressed):
+            with open(compressed, 'wb') as out:
+                subprocess.run(['./pzip', path], stdout=out, check=True)
+        return compressed
+    return path
+
+
+def run_once(args, path, threads, chunk, out_path):
+    """Returns the wall and cpu seconds of one run."""
+    env = dict(os.environ, NTHREADS=str(threads))
+    env.pop('PZIP_CHUNK_SIZE', None)
+    if chunk != 'auto':
+        env['PZIP_CHUNK_SIZE'] = chunk
+    with open(out_path, 'wb') as out:
+        start = time.perf_counter()
+        proc = subprocess.Popen(['./' + args.tool, path], stdout=out, env=env)
+        _, status, usage = os.wait4(proc.pid, 0)
+        wall = time.perf_counter() - start
+    if os.waitstatus_to_exitcode(status):
+        sys.exit('%s failed on %s' % (args.tool, path))
+    return wall, usage.ru_utime + usage.ru_stime
+
+
+def output_format():
+    """The PZIP_FORMAT that pzip runs with, from the environment."""
+    return os.environ.get('PZIP_FORMAT', 'plain')
+
+
+def percentile(values, p):
+    """The nearest rank percentile of values."""
+    values = sorted(values)
+    return values[max(0, -(-len(values) * p // 100) - 1)]
+
+
+def revision():
+    try:
+        return subprocess.run(['git', 'describe', '--always', '--dirty'],
+                              capture_output=True, text=True,
+                              check=True).stdout.strip()
+    except (OSError, subprocess.CalledProcessError):
+        return 'unknown'
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('--tool', choices=('pzip', 'punzip'), default='pzip')
+    parser.add_argument('--corpora', default=','.join(CORPORA),
+                        help='comma separated, from %s' % ','.join(CORPORA))
+    parser.add_argument('--size', type=int, default=64,
+                        help='MiB of each corpus')
+    parser.add_argument('--threads', default='1,2,4,%d' % os.cpu_count(),
+                        help='comma separated NTHREADS to sweep')
+    parser.add_argument('--chunks', default='auto,65536,1048576',
+                        help='comma separated PZIP_CHUNK_SIZE to sweep')
+    parser.add_argument('--repeat', type=int, default=5)
+    parser.add_argument('--dir', default='bench-data',
+                        help='where corpora and output are kept')
+    args = parser.parse_args()
+
+    rev = revision()
+    threads = sorted({int(t) for t in args.threads.split(',')})
+    writer = csv.writer(sys.stdout)
+    writer.writerow(['revision', 'tool', 'format', 'corpus', 'threads',
+                     'chunk_size',
+                     'bytes_in', 'bytes_out', 'ratio', 'median_s', 'p95_s',
+                     'mb_per_s', 'cpu_s'])
+    out_path = os.path.join(args.dir, 'out.tmp')
+    for name in args.corpora.split(','):
+        path = corpus_path(args, name)
+        bytes_in = os.path.getsize(path)
+        for thread_count in threads:
+            for chunk in args.chunks.split(','):
+                runs = [run_once(args, path, thread_count, chunk, out_path)
+                        for _ in range(args.repeat)]
+                walls = [wall for wall, _ in runs]
+                median = percentile(walls, 50)
+                bytes_out = os.path.getsize(out_path)
+                # Throughput is always of uncompressed bytes.
+                raw = bytes_out if args.tool == 'punzip' else bytes_in
+                writer.writerow([
+                    rev, args.tool, output_format(), name, thread_count, chunk,
+                    bytes_in, bytes_out, '%.4f' % (bytes_out / bytes_in),
+                    '%.4f' % median, '%.4f' % percentile(walls, 95),
+                    '%.1f' % (raw / 1e6 / median),
+                    '%.4f' % percentile([cpu for _, cpu in runs], 50)])
+                sys.stdout.flush()
+    os.remove(out_path)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,136 @@
+#ifndef __FORMAT_H__
+#define __FORMAT_H__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+//
+// The compressed format shared with wzip and wunzip: a run of count copies of
+// a char is written as a little endian 4 byte count followed by the char.
+//
+
+static const int INT_OFFSET = 4;
+static const int RECORD_SIZE = 5; // A record is a 4 byte count followed by
+                                  // the char.
+
+typedef struct {
+  char last_char;
+  int count;
+} CompressInfo;
+
+static inline void compress_info_init(CompressInfo *info) {
+  info->last_char = EOF;
+  info->count = 0;
+}
+
+static inline int read_record_count(unsigned char *record) {
+  return (int)((unsigned int)record[0] << 0 | (unsigned int)record[1] << 8 |
+               (unsigned int)record[2] << 16 | (unsigned int)record[3] << 24);
+}
+
+static inline void write_record(unsigned char *record, char c, int count) {
+  record[3] = (count >> 24) & 0xFF;
+  record[2] = (count >> 16) & 0xFF;
+  record[1] = (count >> 8) & 0xFF;
+  record[0] = count & 0xFF;
+  record[4] = c;
+}
+
+//
+// The framed format, written by pzip with PZIP_FORMAT=framed, lets a reader
+// find any offset of the output without decoding what comes before it:
+//
+//   "PZF1"
+//   blocks: u32 record count, u32 decoded bytes, then the records
+//   an empty block header, ending the blocks
+//   index:  u64 decoded offset, u64 block offset, u32 record count per block
+//   footer: u64 block count, u64 decoded bytes, "PZF1"
+//
+// Runs are never merged between blocks, so every block decodes on its own.
+// Integers are little endian, like record counts.
+//
+
+static const char FRAME_MAGIC[] = "PZF1";
+static const int FRAME_MAGIC_SIZE = 4;
+static const int BLOCK_HEADER_SIZE = 8;
+static const int INDEX_ENTRY_SIZE = 20;
+static const int FOOTER_SIZE = 20;
+
+typedef struct {
+  uint64_t decoded_offset; // Where the block's output starts.
+  uint64_t offset;         // Where the block's header starts in the file.
+  uint32_t records;        // The number of records in the block.
+} IndexEntry;
+
+static inline uint64_t read_le(unsigned char *buff, int bytes) {
+  uint64_t value = 0;
+  for (int i = bytes - 1; i >= 0; i--)
+    value = value << 8 | buff[i];
+  return value;
+}
+
+static inline void write_le(unsigned char *buff, uint64_t value, int bytes) {
+  for (int i = 0; i < bytes; i++, value >>= 8)
+    buff[i] = value & 0xFF;
+}
+
+static inline void read_index_entry(unsigned char *buff, IndexEntry *entry) {
+  entry->decoded_offset = read_le(buff, 8);
+  entry->offset = read_le(buff + 8, 8);
+  entry->records = read_le(buff + 16, 4);
+}
+
+static inline void write_index_entry(unsigned char *buff, IndexEntry *entry) {
+  write_le(buff, entry->decoded_offset, 8);
+  write_le(buff + 8, entry->offset, 8);
+  write_le(buff + 16, entry->records, 4);
+}
+
+static inline int is_frame_magic(char *buff) {
+  return !memcmp(buff, FRAME_MAGIC, FRAME_MAGIC_SIZE);
+}
+
+//
+// The compact format, written by pzip with PZIP_FORMAT=compact and wzip -c,
+// stores short runs as they are:
+//
+//   "PZC1"
+//   tokens: a varint header, then for an even header the char repeated
+//           header / 2 times, and for an odd header header / 2 literal bytes
+//
+// Varints are little endian, 7 bits to a byte, with the top bit set on every
+// byte but the last.
+//
+
+static const char COMPACT_MAGIC[] = "PZC1";
+static const int COMPACT_MIN_RUN = 3; // Shorter runs are cheaper as literals.
+static const int MAX_VARINT_SIZE = 10;
+
+static inline int is_compact_magic(char *buff) {
+  return !memcmp(buff, COMPACT_MAGIC, FRAME_MAGIC_SIZE);
+}
+
+// writes value to buff, returning the number of bytes written.
+static inline int write_varint(unsigned char *buff, uint64_t value) {
+  int size = 0;
+  for (; value >= 0x80; value >>= 7)
+    buff[size++] = (value & 0x7F) | 0x80;
+  buff[size++] = value;
+  return size;
+}
+
+// reads a varint from [buff, end) into value, returning the number of bytes
+// read, or 0 if it does not end in time.
+static inline int read_varint(unsigned char *buff, unsigned char *end,
+                              uint64_t *value) {
+  *value = 0;
+  for (int size = 0; size < MAX_VARINT_SIZE && buff + size < end; size++) {
+    *value |= (uint64_t)(buff[size] & 0x7F) << (7 * size);
+    if (!(buff[size] & 0x80))
+      return size + 1;
+  }
+  return 0;
+}
+
+#endif // __FORMAT_H__
@@ -0,0 +1,1150 @@
+#include "pipeline.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+const long MIN_CHUNK_SIZE = 1 << 12;
+const long MAX_CHUNK_SIZE = 1 << 21; // NOTE: output can be 5x the chunk size
+const int CHUNKS_PER_FILE_THREAD = 4; // How many chunks each thread should get
+                                      // from a file, for balance.
+const long TARGET_CHUNK_NS = 1000000; // How long encoding a chunk should take.
+const int STREAM_BUFFERS_PER_THREAD = 2; // How many buffers of streamed input
+                                         // each thread may have in flight.
+const int CHUNKS_PER_THREAD = 4; // How many finished chunks each thread may
+                                 // have waiting on the write head.
+const int PIPE_SIZE = 1 << 20;   // The size to grow an output pipe to.
+const long HUGE_PAGE_SIZE = 1 << 21; // Stream buffers are aligned to this, so
+                                     // each can be backed by a huge page.
+
+const char *NTHREADS =
+    "NTHREADS"; // The name of the variable for setting threads.
+const char *CHUNK_SIZE =
+    "PZIP_CHUNK_SIZE"; // Set to a fixed chunk size, in bytes, to not adapt.
+const char *OUTPUT_MODE =
+    "PZIP_OUTPUT"; // Set to "writev" to never vmsplice into a pipe.
+const char *STATS =
+    "PZIP_STATS"; // Set to print where each thread's time went at exit.
+const char *MAP_MODE =
+    "PZIP_MAP"; // Set to "populate" to fault the whole input in up front.
+const char *PIN = "PZIP_PIN"; // Set to pin every worker to its own cpu.
+
+int POPULATE; // Set when input is faulted in by mmap, not by the workers.
+
+Pipeline PIPELINE;
+
+/*
+ * Where a thread's time went. Each thread only updates its own, and they are
+ * read once every thread has been joined.
+ */
+typedef struct {
+  long tasks;   // Tasks run by a worker, written by the writer, or split.
+  long bytes;   // Bytes of input scanned or split, or bytes written.
+  long units;   // Runs or records a worker emitted.
+  long steals;  // Tasks a worker took from another's deque.
+  long writes;  // Calls the writer made to write out chunks.
+  long run_ns;  // Time a worker spent running tasks.
+  long idle_ns; // Time a worker spent waiting for a task.
+  long write_ns; // Time the writer spent writing.
+  long wait_ns;  // Time spent waiting on the order of the write head: the
+                 // writer for the next chunk, the main thread for space.
+  long read_ns;  // Time the main thread spent reading streamed input.
+} ThreadStats;
+
+ThreadStats MAIN_STATS;
+
+long now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+void sleeper_init(Sleeper *sleeper) {
+  atomic_init(&sleeper->sleeping, 0);
+  pthread_mutex_init(&sleeper->guard, NULL);
+  pthread_cond_init(&sleeper->wake, NULL);
+}
+
+/*
+ * Sleeps until done(arg) returns true. The condition must only become true
+ * through stores that are followed by a call to sleeper_wake.
+ */
+void sleeper_wait(Sleeper *sleeper, int (*done)(int), int arg) {
+  if (done(arg))
+    return;
+  pthread_mutex_lock(&sleeper->guard);
+  atomic_fetch_add(&sleeper->sleeping, 1);
+  while (!done(arg))
+    pthread_cond_wait(&sleeper->wake, &sleeper->guard);
+  atomic_fetch_sub(&sleeper->sleeping, 1);
+  pthread_mutex_unlock(&sleeper->guard);
+}
+
+void sleeper_wake(Sleeper *sleeper) {
+  if (atomic_load(&sleeper->sleeping)) {
+    pthread_mutex_lock(&sleeper->guard);
+    pthread_cond_broadcast(&sleeper->wake);
+    pthread_mutex_unlock(&sleeper->guard);
+  }
+}
+
+void sleeper_destroy(Sleeper *sleeper) {
+  pthread_mutex_destroy(&sleeper->guard);
+  pthread_cond_destroy(&sleeper->wake);
+}
+
+/*
+ * The write head is a ring of chunks indexed by tasknum. Workers publish a
+ * chunk by storing its tasknum, and a single writer thread drains published
+ * chunks in order, so no lock is held around the write.
+ */
+typedef struct {
+  Chunk *chunks;
+  int length;
+  int splice; // Whether stdout is a pipe to vmsplice chunks into.
+  // Read by every thread, written by the writer after each batch.
+  _Alignas(CACHE_LINE_SIZE) atomic_int write_num; // The next tasknum to
+                                                  // write, starting from 1.
+  atomic_int closed; // Set when every task has been published.
+  // Only touched by the writer.
+  _Alignas(CACHE_LINE_SIZE) int error; // Set if a write to stdout failed.
+  int splice_failed;                   // Set if the pipe refused a vmsplice.
+  ThreadStats stats;
+  Sleeper writer; // Where the writer waits for the next chunk.
+  Sleeper space;  // Where the main thread waits for free chunks.
+  pthread_t thread;
+} WriteHead;
+
+WriteHead WRITE_HEAD;
+
+int write_head_num() { return atomic_load(&WRITE_HEAD.write_num); }
+
+Chunk *write_head_chunk(int tasknum) {
+  return WRITE_HEAD.chunks + tasknum % WRITE_HEAD.length;
+}
+
+int write_head_ready(int tasknum) {
+  return atomic_load(&write_head_chunk(tasknum)->tasknum) == tasknum ||
+         atomic_load(&WRITE_HEAD.closed);
+}
+
+int write_head_passed(int tasknum) { return write_head_num() >= tasknum; }
+
+/*
+ * Sleeps until every task before tasknum has been written.
+ */
+void write_head_wait(int tasknum) {
+  sleeper_wait(&WRITE_HEAD.space, write_head_passed, tasknum);
+}
+
+/*
+ * Sleeps until tasknum has a free chunk to write into.
+ */
+void write_head_reserve(int tasknum) {
+  write_head_wait(tasknum - WRITE_HEAD.length + 1);
+}
+
+/*
+ * Hands a chunk to the writer.
+ */
+void write_head_publish(Chunk *chunk, int tasknum) {
+  atomic_store(&chunk->tasknum, tasknum);
+  if (tasknum == write_head_num())
+    sleeper_wake(&WRITE_HEAD.writer);
+}
+
+// writes all of iov to stdout, returning 0 if successful.
+int write_all(struct iovec *iov, int iovcnt) {
+  while (iovcnt > 0) {
+    ssize_t written = writev(STDOUT_FILENO, iov, iovcnt);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      return 1;
+    }
+    while (iovcnt > 0 && (size_t)written >= iov->iov_len) {
+      written -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+  return 0;
+}
+
+#ifdef __linux__
+/*
+ * Hands the pages behind iov to the stdout pipe without copying them, falling
+ * back to write_all if the pipe will not take them. Returns 0 if successful.
+ *
+ * The pipe keeps referencing the pages after this returns, so they must never
+ * be written to again.
+ */
+int splice_all(struct iovec *iov, int iovcnt) {
+  while (iovcnt > 0 && !WRITE_HEAD.splice_failed) {
+    ssize_t spliced = vmsplice(STDOUT_FILENO, iov, iovcnt, 0);
+    if (spliced < 0) {
+      if (errno == EINTR)
+        continue;
+      WRITE_HEAD.splice_failed = 1;
+      break;
+    }
+    while (iovcnt > 0 && (size_t)spliced >= iov->iov_len) {
+      spliced -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + spliced;
+      iov->iov_len -= spliced;
+    }
+  }
+  return write_all(iov, iovcnt);
+}
+
+// returns whether chunks should be spliced into stdout.
+int use_splice() {
+  struct stat sb;
+  char *mode = getenv(OUTPUT_MODE);
+  if (mode && !strcmp(mode, "writev"))
+    return 0;
+  if (fstat(STDOUT_FILENO, &sb) == -1 || !S_ISFIFO(sb.st_mode))
+    return 0;
+  // A bigger pipe means fewer trips through the writer, it is fine if this
+  // fails.
+  fcntl(STDOUT_FILENO, F_SETPIPE_SZ, PIPE_SIZE);
+  return 1;
+}
+#else
+int splice_all(struct iovec *iov, int iovcnt) { return write_all(iov, iovcnt); }
+
+int use_splice() { return 0; }
+#endif
+
+/*
+ * Writes iov to stdout from the writer thread, outside of the chunks. Returns
+ * 0 if successful, and stops all later writes if not.
+ */
+int write_head_write(struct iovec *iov, int iovcnt) {
+  for (int i = 0; i < iovcnt; i++)
+    WRITE_HEAD.stats.bytes += iov[i].iov_len;
+  WRITE_HEAD.stats.writes++;
+  if (!WRITE_HEAD.error)
+    WRITE_HEAD.error = write_all(iov, iovcnt);
+  return WRITE_HEAD.error;
+}
+
+/*
+ * Grows the buff of chunk to hold at least length bytes, keeping its contents.
+ *
+ * Spliced buffers are handed to the kernel, so they come straight from mmap
+ * and are never reused once written.
+ */
+void chunk_reserve(Chunk *chunk, int length) {
+  if (length <= chunk->buff_length)
+    return;
+  if (!WRITE_HEAD.splice) {
+    chunk->buff = (unsigned char *)realloc(chunk->buff, length);
+    assert(chunk->buff != NULL);
+  } else {
+    long page = sysconf(_SC_PAGESIZE);
+    length = (length + page - 1) / page * page;
+    unsigned char *buff = (unsigned char *)mmap(
+        NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(buff != MAP_FAILED);
+    if (chunk->buff) {
+      memcpy(buff, chunk->buff, chunk->buff_index);
+      munmap(chunk->buff, chunk->buff_length);
+    }
+    chunk->buff = buff;
+  }
+  chunk->buff_length = length;
+}
+
+void chunk_release(Chunk *chunk) {
+  if (chunk->buff && WRITE_HEAD.splice)
+    munmap(chunk->buff, chunk->buff_length);
+  else
+    free(chunk->buff);
+  chunk->buff = NULL;
+  chunk->buff_length = 0;
+}
+
+/*
+ * The output buffers made by one worker. A chunk takes its buffer from the
+ * pool of the worker running it, and the writer hands the buffer back once it
+ * is written, so each worker keeps reusing memory it touched first, on its
+ * own node. A worker never has more buffers than the write head has chunks.
+ */
+typedef struct OutputPool {
+  unsigned char **buffs; // The free buffers.
+  int *lengths;          // The capacity of each free buffer.
+  int length;            // The number of free buffers.
+  int capacity;
+  pthread_mutex_t guard;
+} OutputPool;
+
+void output_pool_init(OutputPool *pool, int capacity) {
+  pool->buffs = (unsigned char **)malloc(sizeof(unsigned char *) * capacity);
+  pool->lengths = (int *)malloc(sizeof(int) * capacity);
+  assert(pool->buffs != NULL && pool->lengths != NULL);
+  pool->length = 0;
+  pool->capacity = capacity;
+  pthread_mutex_init(&pool->guard, NULL);
+}
+
+void output_pool_destroy(OutputPool *pool) {
+  for (int i = 0; i < pool->length; i++)
+    free(pool->buffs[i]);
+  free(pool->buffs);
+  free(pool->lengths);
+  pthread_mutex_destroy(&pool->guard);
+}
+
+// gives chunk a free buffer from pool, if there is one. Spliced buffers are
+// never reused, so they are not pooled.
+void output_pool_get(OutputPool *pool, Chunk *chunk) {
+  chunk->pool = pool;
+  if (WRITE_HEAD.splice)
+    return;
+  assert(chunk->buff == NULL);
+  pthread_mutex_lock(&pool->guard);
+  if (pool->length > 0) {
+    pool->length--;
+    chunk->buff = pool->buffs[pool->length];
+    chunk->buff_length = pool->lengths[pool->length];
+  }
+  pthread_mutex_unlock(&pool->guard);
+}
+
+// hands the buffer of a written chunk back to the pool it came from.
+void output_pool_put(Chunk *chunk) {
+  OutputPool *pool = chunk->pool;
+  if (chunk->buff == NULL)
+    return;
+  pthread_mutex_lock(&pool->guard);
+  assert(pool->length < pool->capacity);
+  pool->buffs[pool->length] = chunk->buff;
+  pool->lengths[pool->length] = chunk->buff_length;
+  pool->length++;
+  pthread_mutex_unlock(&pool->guard);
+  chunk->buff = NULL;
+  chunk->buff_length = 0;
+}
+
+int gather_whole_chunk(Chunk *chunk, struct iovec *iov) {
+  iov->iov_base = chunk->buff + chunk->buff_begin;
+  iov->iov_len = chunk->buff_index - chunk->buff_begin;
+  return iov->iov_len;
+}
+
+/*
+ * The writer thread. Gathers every published chunk from the write head into a
+ * single writev (or vmsplice), then releases them to the workers.
+ */
+void *write_head_drain(void *unused) {
+  (void)unused;
+  int max_iov = WRITE_HEAD.length < IOV_MAX ? WRITE_HEAD.length : IOV_MAX;
+  struct iovec *iov = (struct iovec *)malloc(sizeof(struct iovec) * max_iov);
+  assert(iov != NULL);
+  ChunkGatherer gather = PIPELINE.gather ? PIPELINE.gather : gather_whole_chunk;
+  ThreadStats *stats = &WRITE_HEAD.stats;
+  int write_num = write_head_num();
+  while (1) {
+    long start = now_ns();
+    sleeper_wait(&WRITE_HEAD.writer, write_head_ready, write_num);
+    long ready = now_ns();
+    stats->wait_ns += ready - start;
+    int gathered = 0, iovcnt = 0;
+    while (gathered < max_iov &&
+           atomic_load(&write_head_chunk(write_num + gathered)->tasknum) ==
+               write_num + gathered) {
+      int length = gather(write_head_chunk(write_num + gathered), iov + iovcnt);
+      if (length)
+        iovcnt++;
+      stats->bytes += length;
+      gathered++;
+    }
+    if (gathered == 0)
+      break; // closed, and every chunk has been written
+    stats->tasks += gathered;
+    stats->writes++;
+    if (!WRITE_HEAD.error)
+      WRITE_HEAD.error = WRITE_HEAD.splice ? splice_all(iov, iovcnt)
+                                           : write_all(iov, iovcnt);
+    for (int i = 0; i < gathered; i++) {
+      if (WRITE_HEAD.splice)
+        chunk_release(write_head_chunk(write_num + i));
+      else
+        output_pool_put(write_head_chunk(write_num + i));
+    }
+    stats->write_ns += now_ns() - ready;
+    eprintf(3, "Written %d chunks.\n", gathered);
+    write_num += gathered;
+    atomic_store(&WRITE_HEAD.write_num, write_num);
+    sleeper_wake(&WRITE_HEAD.space);
+  }
+  if (PIPELINE.finish)
+    PIPELINE.finish();
+  free(iov);
+  return NULL;
+}
+
+/*
+ * Setup write-head, and start the writer thread.
+ */
+void write_head_init(int length) {
+  atomic_init(&WRITE_HEAD.write_num, 1);
+  atomic_init(&WRITE_HEAD.closed, 0);
+  WRITE_HEAD.error = 0;
+  WRITE_HEAD.splice = use_splice();
+  WRITE_HEAD.splice_failed = 0;
+  WRITE_HEAD.length = length;
+  WRITE_HEAD.chunks =
+      (Chunk *)aligned_alloc(CACHE_LINE_SIZE, sizeof(Chunk) * length);
+  assert(WRITE_HEAD.chunks != NULL);
+  for (int i = 0; i < length; i++) {
+    atomic_init(&WRITE_HEAD.chunks[i].tasknum, 0);
+    WRITE_HEAD.chunks[i].buff_begin = 0;
+    WRITE_HEAD.chunks[i].buff_index = 0;
+    WRITE_HEAD.chunks[i].buff_length = 0;
+    WRITE_HEAD.chunks[i].buff = NULL; // allocated by the first worker to use it
+    WRITE_HEAD.chunks[i].pool = NULL;
+  }
+  sleeper_init(&WRITE_HEAD.writer);
+  sleeper_init(&WRITE_HEAD.space);
+  memset(&WRITE_HEAD.stats, 0, sizeof(ThreadStats));
+  if (pthread_create(&WRITE_HEAD.thread, NULL, write_head_drain, NULL))
+    exit(1);
+}
+
+/*
+ * Stops the writer once it has written every published chunk, returning 0 if
+ * all writes succeeded.
+ */
+int write_head_close() {
+  atomic_store(&WRITE_HEAD.closed, 1);
+  sleeper_wake(&WRITE_HEAD.writer);
+  pthread_join(WRITE_HEAD.thread, NULL);
+  for (int i = 0; i < WRITE_HEAD.length; i++)
+    chunk_release(WRITE_HEAD.chunks + i);
+  free(WRITE_HEAD.chunks);
+  sleeper_destroy(&WRITE_HEAD.writer);
+  sleeper_destroy(&WRITE_HEAD.space);
+  return WRITE_HEAD.error;
+}
+
+/*
+ * The buffers that streamed input is read into. The main thread sleeps when
+ * every buffer is still waiting on a worker, which bounds the memory a stream
+ * can use.
+ */
+typedef struct {
+  MappedFile **buffers; // The free buffers.
+  int length;           // The number of free buffers.
+  int allocated;        // The number of buffers made so far.
+  int capacity;         // The most buffers that will be made.
+  pthread_mutex_t guard;
+  pthread_cond_t returned;
+} BufferPool;
+
+BufferPool BUFFER_POOL;
+
+void buffer_pool_init(int capacity) {
+  BUFFER_POOL.buffers = (MappedFile **)malloc(sizeof(MappedFile *) * capacity);
+  assert(BUFFER_POOL.buffers != NULL);
+  BUFFER_POOL.length = 0;
+  BUFFER_POOL.allocated = 0;
+  BUFFER_POOL.capacity = capacity;
+  pthread_mutex_init(&BUFFER_POOL.guard, NULL);
+  pthread_cond_init(&BUFFER_POOL.returned, NULL);
+}
+
+// returns a free buffer of MAX_CHUNK_SIZE bytes, sleeping until one is free.
+MappedFile *buffer_pool_get() {
+  MappedFile *buffer = NULL;
+  pthread_mutex_lock(&BUFFER_POOL.guard);
+  while (BUFFER_POOL.length == 0 &&
+         BUFFER_POOL.allocated == BUFFER_POOL.capacity)
+    pthread_cond_wait(&BUFFER_POOL.returned, &BUFFER_POOL.guard);
+  if (BUFFER_POOL.length > 0)
+    buffer = BUFFER_POOL.buffers[--BUFFER_POOL.length];
+  else
+    BUFFER_POOL.allocated++;
+  pthread_mutex_unlock(&BUFFER_POOL.guard);
+  if (buffer == NULL) {
+    buffer = (MappedFile *)malloc(sizeof(MappedFile));
+    assert(buffer != NULL);
+    // Huge page aligned, so reads go straight into whole pages and the
+    // kernel can back the buffer with a single huge page.
+    if (posix_memalign((void **)&buffer->file, HUGE_PAGE_SIZE, MAX_CHUNK_SIZE))
+      assert(0);
+#ifdef MADV_HUGEPAGE
+    madvise(buffer->file, MAX_CHUNK_SIZE, MADV_HUGEPAGE);
+#endif
+    buffer->pooled = 1;
+  }
+  return buffer;
+}
+
+void buffer_pool_put(MappedFile *buffer) {
+  pthread_mutex_lock(&BUFFER_POOL.guard);
+  BUFFER_POOL.buffers[BUFFER_POOL.length++] = buffer;
+  pthread_cond_signal(&BUFFER_POOL.returned);
+  pthread_mutex_unlock(&BUFFER_POOL.guard);
+}
+
+/*
+ * Frees the pool, every buffer must have been returned.
+ */
+void buffer_pool_destroy() {
+  assert(BUFFER_POOL.length == BUFFER_POOL.allocated);
+  for (int i = 0; i < BUFFER_POOL.length; i++) {
+    free(BUFFER_POOL.buffers[i]->file);
+    free(BUFFER_POOL.buffers[i]);
+  }
+  free(BUFFER_POOL.buffers);
+  pthread_mutex_destroy(&BUFFER_POOL.guard);
+  pthread_cond_destroy(&BUFFER_POOL.returned);
+}
+
+void mapped_file_release(MappedFile *mapped) {
+  if (atomic_fetch_sub(&mapped->users, 1) == 1) {
+    if (mapped->pooled) {
+      buffer_pool_put(mapped);
+      return;
+    }
+    if (mapped->length > 0)
+      munmap(mapped->file, mapped->length);
+    free(mapped);
+  }
+}
+
+/*
+ * Picks how many bytes go in each task. The size starts from the file size and
+ * thread count, then follows how long workers actually take to run a task,
+ * aiming for TARGET_CHUNK_NS per task.
+ */
+typedef struct {
+  int fixed;                // Set when the size was given by CHUNK_SIZE.
+  int nthreads;             // How many workers share the chunks.
+  long size;                // The size of the next chunk, before file_limit.
+  long file_limit;          // The largest chunk that keeps the file balanced.
+  atomic_long encode_ns;    // Time spent encoding since the last adjustment.
+  atomic_long encode_bytes; // Bytes encoded since the last adjustment.
+} ChunkSizer;
+
+ChunkSizer CHUNK_SIZER;
+
+long clamp_chunk_size(long size) {
+  if (size < MIN_CHUNK_SIZE)
+    return MIN_CHUNK_SIZE;
+  if (size > MAX_CHUNK_SIZE)
+    return MAX_CHUNK_SIZE;
+  return size;
+}
+
+void chunk_sizer_init(int nthreads) {
+  char *given_chunk_size = getenv(CHUNK_SIZE);
+  CHUNK_SIZER.nthreads = nthreads;
+  CHUNK_SIZER.fixed = given_chunk_size != NULL;
+  CHUNK_SIZER.size = given_chunk_size ? atol(given_chunk_size) : 0;
+  CHUNK_SIZER.file_limit = MAX_CHUNK_SIZE;
+  atomic_init(&CHUNK_SIZER.encode_ns, 0);
+  atomic_init(&CHUNK_SIZER.encode_bytes, 0);
+  if (CHUNK_SIZER.fixed && CHUNK_SIZER.size < 1) {
+    fprintf(stderr, "%s must be a positive integer\n", CHUNK_SIZE);
+    exit(1);
+  }
+  // a task's output has to fit its int sized buffer, whatever is asked for
+  if (CHUNK_SIZER.size > MAX_CHUNK_SIZE)
+    CHUNK_SIZER.size = MAX_CHUNK_SIZE;
+}
+
+void chunk_sizer_start_file(size_t length) {
+  long limit = length / (CHUNK_SIZER.nthreads * CHUNKS_PER_FILE_THREAD);
+  CHUNK_SIZER.file_limit = clamp_chunk_size(limit);
+  if (!CHUNK_SIZER.size)
+    CHUNK_SIZER.size = CHUNK_SIZER.file_limit;
+}
+
+/*
+ * Streams have no length to balance, so the size only follows encode time.
+ */
+void chunk_sizer_start_stream() {
+  CHUNK_SIZER.file_limit = MAX_CHUNK_SIZE;
+  if (!CHUNK_SIZER.size)
+    CHUNK_SIZER.size = MAX_CHUNK_SIZE / 8;
+}
+
+/*
+ * Called by workers after running a task.
+ */
+void chunk_sizer_record(long ns, long bytes) {
+  if (!CHUNK_SIZER.fixed) {
+    atomic_fetch_add(&CHUNK_SIZER.encode_ns, ns);
+    atomic_fetch_add(&CHUNK_SIZER.encode_bytes, bytes);
+  }
+}
+
+// returns the size of the next chunk, which is never over MAX_CHUNK_SIZE.
+long chunk_sizer_next() {
+  if (CHUNK_SIZER.fixed)
+    return CHUNK_SIZER.size;
+  long bytes = atomic_load(&CHUNK_SIZER.encode_bytes);
+  if (bytes >= CHUNK_SIZER.size) {
+    long ns = atomic_exchange(&CHUNK_SIZER.encode_ns, 0);
+    atomic_fetch_sub(&CHUNK_SIZER.encode_bytes, bytes);
+    long target = ns > 0 ? (long)((double)TARGET_CHUNK_NS * bytes / ns)
+                         : MAX_CHUNK_SIZE;
+    // Move at most a factor of two at a time, one slow chunk is just noise.
+    if (target > CHUNK_SIZER.size * 2)
+      target = CHUNK_SIZER.size * 2;
+    if (target < CHUNK_SIZER.size / 2)
+      target = CHUNK_SIZER.size / 2;
+    CHUNK_SIZER.size = clamp_chunk_size(target);
+    eprintf(2, "chunk size set to %ld\n", CHUNK_SIZER.size);
+  }
+  return CHUNK_SIZER.size < CHUNK_SIZER.file_limit ? CHUNK_SIZER.size
+                                                   : CHUNK_SIZER.file_limit;
+}
+
+/*
+ * A worker's queue of tasks. The owner takes its oldest task, so its chunks
+ * reach the write head in order, and thieves take the newest.
+ */
+typedef struct {
+  Task *tasks;
+  int capacity;
+  int head;   // The index of the oldest task.
+  int length; // The number of queued tasks.
+  pthread_mutex_t guard;
+} TaskDeque;
+
+/*
+ * A worker. Each part that other threads write sits on its own cache lines,
+ * and workers are allocated cache line aligned, so neighbours never share.
+ */
+typedef struct {
+  // Pushed to by the main thread and stolen from by other workers.
+  _Alignas(CACHE_LINE_SIZE) TaskDeque deque;
+  // Taken from by the worker and handed back to by the writer.
+  _Alignas(CACHE_LINE_SIZE) OutputPool pool;
+  // Only touched by the worker.
+  _Alignas(CACHE_LINE_SIZE) ThreadStats stats;
+  int index; // The position of this worker in SCHEDULER.workers.
+  pthread_t thread;
+} TaskDescriptor;
+
+/*
+ * Spreads tasks over the workers' deques. Idle workers steal from the others
+ * before going to sleep on idle.
+ */
+typedef struct {
+  TaskDescriptor *workers;
+  int nworkers;
+  int next_worker; // The deque the next task is pushed to.
+  // Changed by every push and take, away from what is only read.
+  _Alignas(CACHE_LINE_SIZE) atomic_int queued; // The number of tasks in all
+                                               // deques.
+  atomic_int closed; // Set when no more tasks will be pushed.
+  _Alignas(CACHE_LINE_SIZE) Sleeper idle;
+} Scheduler;
+
+Scheduler SCHEDULER;
+
+void task_deque_init(TaskDeque *deque, int capacity) {
+  deque->tasks = (Task *)malloc(sizeof(Task) * capacity);
+  assert(deque->tasks != NULL);
+  deque->capacity = capacity;
+  deque->head = 0;
+  deque->length = 0;
+  pthread_mutex_init(&deque->guard, NULL);
+}
+
+void task_deque_destroy(TaskDeque *deque) {
+  pthread_mutex_destroy(&deque->guard);
+  free(deque->tasks);
+}
+
+void task_deque_push(TaskDeque *deque, Task *task) {
+  pthread_mutex_lock(&deque->guard);
+  assert(deque->length < deque->capacity);
+  deque->tasks[(deque->head + deque->length) % deque->capacity] = *task;
+  deque->length++;
+  atomic_fetch_add(&SCHEDULER.queued, 1);
+  pthread_mutex_unlock(&deque->guard);
+}
+
+// Takes the oldest task, or the newest if steal is set, returning 0 if the
+// deque is empty.
+int task_deque_take(TaskDeque *deque, Task *task, int steal) {
+  pthread_mutex_lock(&deque->guard);
+  int out = deque->length > 0;
+  if (out && steal) {
+    *task = deque->tasks[(deque->head + deque->length - 1) % deque->capacity];
+    deque->length--;
+  } else if (out) {
+    *task = deque->tasks[deque->head];
+    deque->head = (deque->head + 1) % deque->capacity;
+    deque->length--;
+  }
+  if (out)
+    atomic_fetch_sub(&SCHEDULER.queued, 1);
+  pthread_mutex_unlock(&deque->guard);
+  return out;
+}
+
+int scheduler_has_work(int unused) {
+  (void)unused; // sleeper_wait passes an argument that is not needed here
+  return atomic_load(&SCHEDULER.queued) > 0 || atomic_load(&SCHEDULER.closed);
+}
+
+void scheduler_push(Task *task) {
+  TaskDeque *deque = &SCHEDULER.workers[SCHEDULER.next_worker].deque;
+  SCHEDULER.next_worker = (SCHEDULER.next_worker + 1) % SCHEDULER.nworkers;
+  task_deque_push(deque, task);
+  sleeper_wake(&SCHEDULER.idle);
+}
+
+// Takes a task for desc, stealing from the other workers if its own deque is
+// empty. Returns 0 once the scheduler is closed and every task is taken.
+int scheduler_take(TaskDescriptor *desc, Task *task) {
+  while (1) {
+    if (task_deque_take(&desc->deque, task, 0))
+      return 1;
+    for (int i = 1; i < SCHEDULER.nworkers; i++) {
+      TaskDescriptor *victim =
+          SCHEDULER.workers + (desc->index + i) % SCHEDULER.nworkers;
+      if (task_deque_take(&victim->deque, task, 1)) {
+        desc->stats.steals++;
+        eprintf(3, "thread %d stole task %d from thread %d\n", desc->index,
+                task->tasknum, victim->index);
+        return 1;
+      }
+    }
+    if (atomic_load(&SCHEDULER.closed) && !atomic_load(&SCHEDULER.queued))
+      return 0;
+    sleeper_wait(&SCHEDULER.idle, scheduler_has_work, 0);
+  }
+}
+
+void scheduler_close() {
+  atomic_store(&SCHEDULER.closed, 1);
+  sleeper_wake(&SCHEDULER.idle);
+}
+
+/*
+ * Hands a task to the workers, once the write head has room for its output.
+ */
+void submit_task(Task *task) {
+  atomic_fetch_add(&task->source->users, 1);
+  long start = now_ns();
+  write_head_reserve(task->tasknum);
+  MAIN_STATS.wait_ns += now_ns() - start;
+  MAIN_STATS.tasks++;
+  scheduler_push(task);
+}
+
+/*
+ * Starts reading the pages of a mapped task in before it is run, so they
+ * arrive in one go rather than a page fault at a time. Pages read this way
+ * are allocated on the node of the worker that asked for them.
+ */
+void prefetch_task(Task *task) {
+#ifdef __linux__
+  if (task->source->pooled || POPULATE)
+    return;
+  long page = sysconf(_SC_PAGESIZE);
+  uintptr_t begin = (uintptr_t)task->read_begin / page * page;
+  madvise((void *)begin, (uintptr_t)task->read_end - begin, MADV_WILLNEED);
+#endif
+}
+
+void *write_section(TaskDescriptor *desc) {
+  Task task;
+  ThreadStats *stats = &desc->stats;
+  long idle = now_ns();
+  while (scheduler_take(desc, &task)) {
+    eprintf(2, "executing task_num=%d on thread %lu\n", task.tasknum,
+            (long)desc->thread);
+    Chunk *chunk = write_head_chunk(task.tasknum);
+    long start = now_ns();
+    output_pool_get(&desc->pool, chunk);
+    prefetch_task(&task);
+    stats->units += PIPELINE.run_task(&task, chunk);
+    long end = now_ns();
+    stats->tasks++;
+    stats->bytes += task.read_end - task.read_begin;
+    stats->run_ns += end - start;
+    stats->idle_ns += start - idle;
+    idle = end;
+    chunk_sizer_record(end - start, task.read_end - task.read_begin);
+    mapped_file_release(task.source);
+    write_head_publish(chunk, task.tasknum);
+    eprintf(2, "finished task_num=%d on thread %lu\n", task.tasknum,
+            (long)desc->thread);
+  }
+  stats->idle_ns += now_ns() - idle;
+  return NULL;
+}
+
+// mmap the file open on fd into memeory,
+// setting file to the file,
+// returning 0 if successful
+int mmap_file(int fd, size_t length, char **file) {
+  int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+  if (POPULATE)
+    flags |= MAP_POPULATE;
+#endif
+  *file = NULL;
+  if (length > 0)
+    *file = mmap(NULL, length, PROT_READ, flags, fd, 0);
+  if (*file == MAP_FAILED)
+    return 3;
+#ifdef __linux__
+  // Each task is read front to back, and the kernel can back the mapping
+  // with huge pages where the file system supports it. Both are only hints.
+  if (length > 0) {
+    madvise(*file, length, MADV_SEQUENTIAL);
+    madvise(*file, length, MADV_HUGEPAGE);
+  }
+#endif
+  return 0;
+}
+
+// reads from fd until buff holds length bytes or the input ends,
+// returning the number of bytes read, or -1 on error.
+ssize_t read_full(int fd, char *buff, size_t length) {
+  size_t total = 0;
+  while (total < length) {
+    ssize_t got = read(fd, buff + total, length - total);
+    if (got < 0 && errno == EINTR)
+      continue;
+    if (got < 0)
+      return -1;
+    if (got == 0)
+      break;
+    total += got;
+  }
+  return total;
+}
+
+// maps a file and splits all of it into tasks, returning 0 if successful.
+int split_mapped_file(int fd, size_t length, int *task_num) {
+  MappedFile *mapped = (MappedFile *)malloc(sizeof(MappedFile));
+  assert(mapped != NULL);
+  mapped->length = length;
+  mapped->pooled = 0;
+  mapped->offset = 0;
+  if (mmap_file(fd, length, &mapped->file)) {
+    free(mapped);
+    return 1;
+  }
+  atomic_init(&mapped->users, 1);
+  MAIN_STATS.bytes += length;
+  chunk_sizer_start_file(mapped->length);
+  int out = PIPELINE.split(mapped, task_num);
+  // The workers unmap the file once they are done with it.
+  mapped_file_release(mapped);
+  return out;
+}
+
+/*
+ * Reads a pipe, socket or terminal into buffers from the pool, splitting each
+ * buffer into tasks as soon as it is full. Returns 0 if successful.
+ *
+ * Buffers are filled to a multiple of the pipeline's input_unit, so only the
+ * last one can end part way through a unit.
+ */
+int split_stream(int fd, int *task_num) {
+  off_t offset = 0;
+  chunk_sizer_start_stream();
+  while (1) {
+    long start = now_ns();
+    MappedFile *buffer = buffer_pool_get();
+    long size = chunk_sizer_next();
+    size -= size % PIPELINE.input_unit;
+    if (size == 0)
+      size = PIPELINE.input_unit;
+    ssize_t length = read_full(fd, buffer->file, size);
+    MAIN_STATS.read_ns += now_ns() - start;
+    if (length <= 0) {
+      buffer_pool_put(buffer);
+      return length < 0;
+    }
+    MAIN_STATS.bytes += length;
+    buffer->length = length;
+    buffer->offset = offset;
+    offset += length;
+    atomic_init(&buffer->users, 1);
+    int out = PIPELINE.split(buffer, task_num);
+    mapped_file_release(buffer);
+    if (out || length < size)
+      return out;
+  }
+}
+
+// splits the named file into tasks, or stdin if the name is "-",
+// returning 0 if successful.
+int split_file(char *file_name, int *task_num) {
+  struct stat sb;
+  int fd = strcmp(file_name, "-") ? open(file_name, O_RDONLY) : STDIN_FILENO;
+  if (fd == -1)
+    return 1;
+  int out = 2;
+  if (fstat(fd, &sb) != -1)
+    out = S_ISREG(sb.st_mode) ? split_mapped_file(fd, sb.st_size, task_num)
+                              : split_stream(fd, task_num);
+  if (fd != STDIN_FILENO)
+    close(fd);
+  return out;
+}
+
+int process_files(char **fnames, int flength, TaskDescriptor *tasks,
+                  int ntasks) {
+  int out = 0;
+
+  // PROCESS FILES
+  // Files are split as fast as the write head has room, so the workers keep
+  // going across file boundaries.
+  int task_num = 0;
+  for (int file_i = 1; file_i < flength; file_i++) {
+    if (split_file(fnames[file_i], &task_num)) {
+      out = 1;
+      break;
+    }
+  }
+  eprintf(2, "Begun cleanup\n");
+
+  // Join
+  scheduler_close();
+  eprintf(2, "Joining threads\n");
+  for (int i = 0; i < ntasks; i++) {
+    pthread_join(tasks[i].thread, NULL);
+    eprintf(2, "thread %lu joined\n", (long)tasks[i].thread);
+  }
+  if (write_head_close())
+    out = 1;
+  return out;
+}
+
+#ifdef __linux__
+// reads a list like "0-15,32-47" from path into ids, returning how many ids
+// it has, at most max, or 0 if path can not be read.
+int read_id_list(char *path, int *ids, int max) {
+  char buf[4096];
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL)
+    return 0;
+  char *list = fgets(buf, sizeof(buf), fp);
+  fclose(fp);
+  int n = 0;
+  while (list && *list && *list != '\n') {
+    char *rest;
+    long first = strtol(list, &rest, 10), last = first;
+    if (rest == list)
+      break;
+    if (*rest == '-')
+      last = strtol(rest + 1, &rest, 10);
+    for (long id = first; id <= last && n < max; id++)
+      ids[n++] = id;
+    list = *rest == ',' ? rest + 1 : rest;
+  }
+  return n;
+}
+
+/*
+ * Orders the cpus this process may run on so that consecutive workers go to
+ * different NUMA nodes, spreading them over every node's memory. Returns the
+ * number of cpus, or 0 if they could not be found.
+ */
+int worker_cpus(int *cpus) {
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(cpu_set_t), &allowed))
+    return 0;
+  // The cpus of each node, one node after the other. Node numbers can have
+  // gaps, so the nodes come from the online list.
+  int ncpus = 0, nnodes = 0, node_begin[CPU_SETSIZE + 1];
+  int nodes[CPU_SETSIZE], node_cpus[CPU_SETSIZE];
+  int online =
+      read_id_list("/sys/devices/system/node/online", nodes, CPU_SETSIZE);
+  char path[64];
+  for (int i = 0; i < online; i++) {
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+             nodes[i]);
+    int n = read_id_list(path, node_cpus, CPU_SETSIZE);
+    node_begin[nnodes] = ncpus;
+    for (int j = 0; j < n && ncpus < CPU_SETSIZE; j++)
+      if (node_cpus[j] < CPU_SETSIZE && CPU_ISSET(node_cpus[j], &allowed))
+        cpus[ncpus++] = node_cpus[j];
+    if (ncpus > node_begin[nnodes])
+      nnodes++;
+  }
+  if (nnodes == 0) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+      if (CPU_ISSET(cpu, &allowed))
+        cpus[ncpus++] = cpu;
+    return ncpus;
+  }
+  node_begin[nnodes] = ncpus;
+  // Deal the cpus out a node at a time.
+  int ordered[CPU_SETSIZE], taken = 0;
+  for (int i = 0; taken < ncpus; i++)
+    for (int node = 0; node < nnodes; node++)
+      if (node_begin[node] + i < node_begin[node + 1])
+        ordered[taken++] = cpus[node_begin[node] + i];
+  memcpy(cpus, ordered, sizeof(int) * ncpus);
+  return ncpus;
+}
+#endif
+
+// pins worker i to the i-th cpu from worker_cpus through pattr, if PIN is set.
+void pin_worker(pthread_attr_t *pattr, int *cpus, int ncpus, int i) {
+#ifdef __linux__
+  if (ncpus > 0) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpus[i % ncpus], &set);
+    pthread_attr_setaffinity_np(pattr, sizeof(cpu_set_t), &set);
+  }
+#endif
+}
+
+TaskDescriptor *setup_tasks(int ntasks) {
+
+  // INITIALIZE TASKS
+  TaskDescriptor *tasks = (TaskDescriptor *)aligned_alloc(
+      CACHE_LINE_SIZE, sizeof(TaskDescriptor) * ntasks);
+  assert(tasks != NULL);
+  for (int i = 0; i < ntasks; i++) {
+    // A deque never holds more tasks than the write head has chunks.
+    task_deque_init(&tasks[i].deque, WRITE_HEAD.length);
+    output_pool_init(&tasks[i].pool, WRITE_HEAD.length);
+    tasks[i].index = i;
+    memset(&tasks[i].stats, 0, sizeof(ThreadStats));
+  }
+  SCHEDULER.workers = tasks;
+  SCHEDULER.nworkers = ntasks;
+  SCHEDULER.next_worker = 0;
+  atomic_init(&SCHEDULER.queued, 0);
+  atomic_init(&SCHEDULER.closed, 0);
+  sleeper_init(&SCHEDULER.idle);
+  buffer_pool_init(ntasks * STREAM_BUFFERS_PER_THREAD);
+
+  // INITIALIZE THREADS
+  // Pinned workers each fault in their own tasks, which go to them round
+  // robin, so most of the input a worker reads is on its own node.
+  pthread_attr_t pattr;
+  pthread_attr_init(&pattr);
+  int ncpus = 0;
+#ifdef __linux__
+  int cpus[CPU_SETSIZE];
+  if (getenv(PIN))
+    ncpus = worker_cpus(cpus);
+#else
+  int *cpus = NULL;
+#endif
+  for (int i = 0; i < ntasks; i++) {
+    pin_worker(&pattr, cpus, ncpus, i);
+    if (pthread_create(&(tasks + i)->thread, &pattr,
+                       (void *(*)(void *))write_section, (tasks) + i))
+      exit(1);
+  }
+  pthread_attr_destroy(&pattr);
+  return tasks;
+}
+
+void cleanup_tasks(TaskDescriptor *tasks, int ntasks) {
+  for (int i = 0; i < ntasks; i++) {
+    task_deque_destroy(&tasks[i].deque);
+    output_pool_destroy(&tasks[i].pool);
+  }
+  free(tasks);
+  sleeper_destroy(&SCHEDULER.idle);
+  buffer_pool_destroy();
+}
+
+double seconds(long ns) { return ns / 1e9; }
+
+/*
+ * Prints where each thread's time went, to see whether a run was bound by
+ * scanning, by the order of the output or by I/O.
+ */
+void print_stats(TaskDescriptor *tasks, int ntasks, long wall_ns) {
+  ThreadStats total;
+  memset(&total, 0, sizeof(ThreadStats));
+  fprintf(stderr, "%.3f s with %d workers\n", seconds(wall_ns), ntasks);
+  for (int i = 0; i < ntasks; i++) {
+    ThreadStats *stats = &tasks[i].stats;
+    fprintf(stderr,
+            "worker %d: %ld tasks, %ld bytes scanned, %ld runs, %ld steals, "
+            "running %.3f s, idle %.3f s\n",
+            i, stats->tasks, stats->bytes, stats->units, stats->steals,
+            seconds(stats->run_ns), seconds(stats->idle_ns));
+    total.tasks += stats->tasks;
+    total.bytes += stats->bytes;
+    total.units += stats->units;
+    total.steals += stats->steals;
+    total.run_ns += stats->run_ns;
+    total.idle_ns += stats->idle_ns;
+  }
+  fprintf(stderr,
+          "workers: %ld tasks, %ld bytes scanned, %ld runs, %ld steals, "
+          "running %.3f s, idle %.3f s\n",
+          total.tasks, total.bytes, total.units, total.steals,
+          seconds(total.run_ns), seconds(total.idle_ns));
+  ThreadStats *writer = &WRITE_HEAD.stats;
+  fprintf(stderr,
+          "writer: %ld chunks, %ld bytes in %ld writes, writing %.3f s, "
+          "waiting for the next chunk %.3f s\n",
+          writer->tasks, writer->bytes, writer->writes,
+          seconds(writer->write_ns), seconds(writer->wait_ns));
+  fprintf(stderr,
+          "main: %ld tasks, %ld bytes split, reading %.3f s, waiting for the "
+          "write head %.3f s\n",
+          MAIN_STATS.tasks, MAIN_STATS.bytes, seconds(MAIN_STATS.read_ns),
+          seconds(MAIN_STATS.wait_ns));
+}
+
+/*
+ * Runs every named file through pipeline with nthreads workers, writing the
+ * output to stdout. Returns 0 if successful.
+ */
+int run_pipeline(Pipeline *pipeline, char **fnames, int flength,
+                 int nthreads) {
+  PIPELINE = *pipeline;
+  long start = now_ns();
+  char *map_mode = getenv(MAP_MODE);
+  POPULATE = map_mode && !strcmp(map_mode, "populate");
+  memset(&MAIN_STATS, 0, sizeof(ThreadStats));
+  chunk_sizer_init(nthreads);
+
+  // SETUP HEAD
+  write_head_init(nthreads * CHUNKS_PER_THREAD);
+
+  TaskDescriptor *tasks = setup_tasks(nthreads);
+  // Joins threads, to tasks can now be freed.
+  int out = process_files(fnames, flength, tasks, nthreads);
+  if (getenv(STATS))
+    print_stats(tasks, nthreads, now_ns() - start);
+
+  // cleanup
+  cleanup_tasks(tasks, nthreads);
+  return out;
+}
@@ -0,0 +1,138 @@
+#ifndef __PIPELINE_H__
+#define __PIPELINE_H__
+
+#ifdef __linux__
+#define _GNU_SOURCE // for vmsplice
+#endif
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+//
+// The threading model shared by pzip and punzip.
+//
+// The main thread maps each input (or reads it into pooled buffers if it can
+// not be mapped) and splits it into tasks. Tasks are spread over per-worker
+// deques, and idle workers steal from each other. Each task's output goes into
+// a chunk of the write head, a ring indexed by tasknum that a single writer
+// thread drains to stdout in order.
+//
+
+#ifndef DEBUG_INFO
+static const unsigned int __DEBUG_INFO = 0;
+#define DEBUG_INFO
+#endif
+
+#define eprintf(priority, ...)                                                 \
+  if (priority <= __DEBUG_INFO)                                                \
+  fprintf(stderr, __VA_ARGS__)
+
+extern const long MIN_CHUNK_SIZE;
+extern const long MAX_CHUNK_SIZE;
+
+extern const char *NTHREADS;
+extern const char *CHUNK_SIZE;
+extern const char *OUTPUT_MODE;
+extern const char *STATS;
+
+/*
+ * A place for threads to sleep until some condition holds. The count of
+ * sleepers lets the waking side skip the mutex entirely when nobody is asleep.
+ */
+typedef struct {
+  atomic_int sleeping;
+  pthread_mutex_t guard;
+  pthread_cond_t wake;
+} Sleeper;
+
+void sleeper_init(Sleeper *sleeper);
+void sleeper_wait(Sleeper *sleeper, int (*done)(int), int arg);
+void sleeper_wake(Sleeper *sleeper);
+void sleeper_destroy(Sleeper *sleeper);
+
+// State written by different threads is kept this far apart, so one thread's
+// writes do not keep taking the line away from the others.
+#define CACHE_LINE_SIZE 64
+
+struct OutputPool;
+
+/*
+ * The output of one task. A task may leave headroom before its output, for
+ * the gatherer to use. Each chunk has a cache line of its own, as neighbouring
+ * chunks are filled by different workers.
+ */
+typedef struct {
+  // The task whose output is in buff, once published.
+  _Alignas(CACHE_LINE_SIZE) atomic_int tasknum;
+  int buff_begin;          // The start of the output in buff.
+  int buff_index;          // The end of the output in buff.
+  int buff_length;         // The capacity of buff.
+  unsigned char *buff;     // Headroom followed by the output.
+  struct OutputPool *pool; // Where buff goes back to once written.
+} Chunk;
+
+void chunk_reserve(Chunk *chunk, int length);
+
+/*
+ * Adds the output of a chunk to iov, returning the number of bytes added.
+ * Called in order by the writer thread.
+ */
+typedef int (*ChunkGatherer)(Chunk *chunk, struct iovec *iov);
+
+int write_all(struct iovec *iov, int iovcnt);
+int write_head_num();
+int write_head_write(struct iovec *iov, int iovcnt);
+
+/*
+ * A mapped input file, or a buffer of streamed input. It is released once the
+ * main thread has split it and every task reading it is done.
+ */
+typedef struct {
+  char *file;
+  size_t length;
+  atomic_int users; // Tasks still reading the file, plus one while splitting.
+  int pooled;       // Set if file is a buffer from the BUFFER_POOL.
+  off_t offset;     // Where file starts in its input, for streamed buffers.
+} MappedFile;
+
+typedef struct {
+  int tasknum;        // The sequential ordering of writes, starting from 1.
+  char *read_begin;   // The begininning of the sequence to encode.
+  char *read_end;     // The end of the sequence to encode.
+  MappedFile *source; // The file read_begin points into.
+  // Decoding tasks also know where their output goes.
+  long skip;   // The bytes decoded from the records to leave out.
+  long length; // The number of bytes the task decodes to.
+  off_t offset; // Where in the output those bytes go.
+  int compact;  // Set if the records are compact tokens.
+} Task;
+
+void submit_task(Task *task);
+
+void chunk_sizer_init(int nthreads);
+void chunk_sizer_record(long ns, long bytes);
+long chunk_sizer_next();
+
+/*
+ * What makes a pipeline pzip or punzip.
+ */
+typedef struct {
+  // Splits a whole input into tasks with submit_task, returning 0 if the
+  // input was valid.
+  int (*split)(MappedFile *input, int *task_num);
+  // Turns a task's input into output in chunk, returning the number of runs
+  // or records it wrote or read.
+  long (*run_task)(Task *task, Chunk *chunk);
+  ChunkGatherer gather; // NULL to write every chunk as it is.
+  void (*finish)(void); // Called by the writer after the last chunk, or NULL.
+  int input_unit;       // Streamed input is read in multiples of this.
+} Pipeline;
+
+int run_pipeline(Pipeline *pipeline, char **fnames, int flength, int nthreads);
+
+#endif // __PIPELINE_H__
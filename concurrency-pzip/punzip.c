@@ -0,0 +1,424 @@
+#include "format.h"
+#include "pipeline.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+const long MAX_TASK_OUTPUT = 1 << 22; // The most bytes a task decodes to, so a
+                                      // few long runs can not use all memory.
+
+long OUTPUT_OFFSET; // The bytes of output split into tasks so far.
+long RUN_SKIP;      // The bytes of the next record's run already split off.
+
+long RANGE_BEGIN = 0; // The first byte of output to write.
+long RANGE_END = LONG_MAX; // The byte after the last one to write.
+int RANGE_GIVEN;      // Set if a range was given with -r.
+int RANGE_FROM_END;   // Set if RANGE_BEGIN counts back from the end.
+int RANGE_DONE;       // Set once every task in the range has been submitted.
+
+off_t OUTPUT_BASE; // Where stdout was when punzip started.
+int USE_PWRITE;    // Set if workers write their chunks straight to stdout.
+atomic_int PWRITE_ERROR;
+
+// returns the length of the run in record, treating a negative count as
+// empty like wunzip does.
+long record_run(unsigned char *record) {
+  int count = read_record_count(record);
+  return count > 0 ? count : 0;
+}
+
+/*
+ * A record, or a token of the compact format.
+ */
+typedef struct {
+  long size;           // The bytes it takes up in the input.
+  long run;            // The bytes it decodes to.
+  int literal;         // Set if data holds run bytes, instead of one char.
+  unsigned char *data; // What it decodes from.
+} Token;
+
+// reads the record or token at head into token, returning 0 if it ends past
+// end.
+int read_token(char *head, char *end, int compact, Token *token) {
+  unsigned char *buff = (unsigned char *)head;
+  if (!compact) {
+    if (end - head < RECORD_SIZE)
+      return 0;
+    token->size = RECORD_SIZE;
+    token->run = record_run(buff);
+    token->literal = 0;
+    token->data = buff + INT_OFFSET;
+    return 1;
+  }
+  uint64_t header;
+  int size = read_varint(buff, (unsigned char *)end, &header);
+  token->literal = header & 1;
+  token->data = buff + size;
+  // A run must fit in the output, and a literal in the input.
+  if (!size || header >> 1 > (uint64_t)LONG_MAX / 2 ||
+      (token->literal && header >> 1 > (uint64_t)(end - head - size)))
+    return 0;
+  token->run = header >> 1;
+  token->size = size + (token->literal ? token->run : 1);
+  return token->size <= end - head;
+}
+
+/*
+ * Cuts the output of task down to the range, and submits it if any is left.
+ * task->offset is where its output starts in the whole output, and is moved to
+ * where it goes in what is written.
+ */
+void submit_in_range(Task *task, int *task_num) {
+  long begin = task->offset;
+  long end = task->offset + task->length;
+  if (end > RANGE_END)
+    end = RANGE_END;
+  if (end >= RANGE_END)
+    RANGE_DONE = 1;
+  if (end <= RANGE_BEGIN)
+    return;
+  if (begin < RANGE_BEGIN) {
+    task->skip += RANGE_BEGIN - begin;
+    begin = RANGE_BEGIN;
+  }
+  task->offset = begin - RANGE_BEGIN;
+  task->length = end - begin;
+  task->tasknum = ++(*task_num);
+  eprintf(3, "Task %d decodes to %ld bytes at offset %ld\n", task->tasknum,
+          task->length, (long)task->offset);
+  submit_task(task);
+}
+
+/*
+ * Splits the records in [head, end) into tasks, cutting a task when it has
+ * read about the chunk size or will decode to MAX_TASK_OUTPUT. A run longer
+ * than that is split between tasks, the later ones skipping what the earlier
+ * ones decoded.
+ *
+ * Every task knows its offset in the output from the counts before it, so
+ * tasks can decode (and with pwrite, write) in any order.
+ */
+int split_record_range(MappedFile *input, char *head, char *end, int compact,
+                       int *task_num) {
+  Token token;
+  int truncated = 0;
+  while (head < end && !RANGE_DONE && !truncated) {
+    Task task;
+    long size = chunk_sizer_next();
+    size = size > RECORD_SIZE ? size - size % RECORD_SIZE : RECORD_SIZE;
+    char *limit = end - head > size ? head + size : end;
+    task.read_begin = head;
+    task.skip = RUN_SKIP;
+    task.length = 0;
+    task.offset = OUTPUT_OFFSET;
+    task.source = input;
+    task.compact = compact;
+    while (head < limit) {
+      if (!read_token(head, end, compact, &token)) {
+        // Still write out the records before it.
+        truncated = 1;
+        break;
+      }
+      long run = token.run - RUN_SKIP;
+      if (task.length + run > MAX_TASK_OUTPUT) {
+        RUN_SKIP += MAX_TASK_OUTPUT - task.length;
+        task.length = MAX_TASK_OUTPUT;
+        break;
+      }
+      task.length += run;
+      RUN_SKIP = 0;
+      head += token.size;
+    }
+    // A task ending part way through a run also reads that record.
+    task.read_end = RUN_SKIP ? head + token.size : head;
+    OUTPUT_OFFSET += task.length;
+    submit_in_range(&task, task_num);
+  }
+  return truncated;
+}
+
+// returns the decoded length of the records in [head, end), up to the first
+// that is cut off.
+long decoded_length(char *head, char *end, int compact) {
+  long length = 0;
+  Token token;
+  for (; read_token(head, end, compact, &token); head += token.size)
+    length += token.run;
+  return length;
+}
+
+// turns a range counting back from the end of an input of length bytes into
+// one counting from the start.
+void resolve_range(long length) {
+  if (RANGE_FROM_END) {
+    RANGE_BEGIN = length > RANGE_BEGIN ? length - RANGE_BEGIN : 0;
+    RANGE_FROM_END = 0;
+  }
+}
+
+/*
+ * Reads the index of a framed input, returning the number of blocks or -1 if
+ * input is not framed. Sets index to the first entry, and decoded to the
+ * decoded length of the whole input.
+ */
+long read_frame_index(MappedFile *input, unsigned char **index,
+                      long *decoded) {
+  unsigned char *file = (unsigned char *)input->file;
+  long length = input->length;
+  long least = FRAME_MAGIC_SIZE + BLOCK_HEADER_SIZE + FOOTER_SIZE;
+  if (input->pooled || length < least || !is_frame_magic(input->file) ||
+      !is_frame_magic(input->file + length - FRAME_MAGIC_SIZE))
+    return -1;
+  unsigned char *footer = file + length - FOOTER_SIZE;
+  uint64_t blocks = read_le(footer, 8);
+  if (blocks > (uint64_t)(length - least) / INDEX_ENTRY_SIZE)
+    return -1;
+  *index = footer - blocks * INDEX_ENTRY_SIZE;
+  *decoded = read_le(footer + 8, 8);
+  return blocks;
+}
+
+/*
+ * Splits the blocks of a framed input that overlap the range into tasks,
+ * straight from its index. Returns 0 if the index is valid.
+ */
+int split_frames(MappedFile *input, unsigned char *index, long blocks,
+                 long decoded, int *task_num) {
+  char *blocks_end = (char *)index - BLOCK_HEADER_SIZE;
+  long base = OUTPUT_OFFSET;
+  resolve_range(decoded);
+  // Find the last block starting at or before the range.
+  long first = 0, last = blocks;
+  while (last - first > 1) {
+    long middle = (first + last) / 2;
+    IndexEntry entry;
+    read_index_entry(index + middle * INDEX_ENTRY_SIZE, &entry);
+    if (base + (long)entry.decoded_offset <= RANGE_BEGIN)
+      first = middle;
+    else
+      last = middle;
+  }
+  for (long i = first; i < blocks && !RANGE_DONE; i++) {
+    IndexEntry entry, next;
+    read_index_entry(index + i * INDEX_ENTRY_SIZE, &entry);
+    next.decoded_offset = decoded;
+    if (i + 1 < blocks)
+      read_index_entry(index + (i + 1) * INDEX_ENTRY_SIZE, &next);
+    char *head = input->file + entry.offset + BLOCK_HEADER_SIZE;
+    if (entry.offset < FRAME_MAGIC_SIZE || head > blocks_end ||
+        (blocks_end - head) / RECORD_SIZE < entry.records ||
+        next.decoded_offset < entry.decoded_offset)
+      return 1;
+    char *end = head + (long)entry.records * RECORD_SIZE;
+    long length = next.decoded_offset - entry.decoded_offset;
+    if (length > MAX_TASK_OUTPUT) {
+      // Not from pzip, fall back to splitting by the counts.
+      if (decoded_length(head, end, 0) != length)
+        return 1;
+      OUTPUT_OFFSET = base + entry.decoded_offset;
+      split_record_range(input, head, end, 0, task_num);
+      continue;
+    }
+    Task task;
+    task.read_begin = head;
+    task.read_end = end;
+    task.skip = 0;
+    task.length = length;
+    task.offset = base + entry.decoded_offset;
+    task.source = input;
+    task.compact = 0;
+    submit_in_range(&task, task_num);
+  }
+  OUTPUT_OFFSET = base + decoded;
+  return 0;
+}
+
+/*
+ * Splits a whole input into tasks, from its index if it is framed and by its
+ * counts if not.
+ */
+int split_records(MappedFile *input, int *task_num) {
+  unsigned char *index;
+  long decoded;
+  long blocks = read_frame_index(input, &index, &decoded);
+  if (blocks >= 0) {
+    if (split_frames(input, index, blocks, decoded, task_num)) {
+      fprintf(stderr, "punzip: corrupt index\n");
+      return 1;
+    }
+    return 0;
+  }
+  char *head = input->file;
+  char *end = input->file + input->length;
+  int starts = input->offset == 0 && input->length >= (size_t)FRAME_MAGIC_SIZE;
+  if (starts && is_frame_magic(head)) {
+    fprintf(stderr, input->pooled ? "punzip: framed input must be a file\n"
+                                  : "punzip: missing index\n");
+    return 1;
+  }
+  // Streamed buffers are cut on record boundaries, which tokens don't have.
+  int compact = starts && is_compact_magic(head);
+  if (compact && input->pooled) {
+    fprintf(stderr, "punzip: compact input must be a file\n");
+    return 1;
+  }
+  if (compact)
+    head += FRAME_MAGIC_SIZE;
+  if (RANGE_FROM_END && input->pooled) {
+    fprintf(stderr, "punzip: -r from the end needs a file\n");
+    return 1;
+  }
+  if (RANGE_FROM_END)
+    resolve_range(decoded_length(head, end, compact));
+  if (split_record_range(input, head, end, compact, task_num)) {
+    fprintf(stderr, "punzip: truncated record\n");
+    return 1;
+  }
+  return 0;
+}
+
+// writes all of buff to stdout at offset, returning 0 if successful.
+int pwrite_all(unsigned char *buff, long length, off_t offset) {
+  while (length > 0) {
+    ssize_t written = pwrite(STDOUT_FILENO, buff, length, offset);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written < 0)
+      return 1;
+    buff += written;
+    length -= written;
+    offset += written;
+  }
+  return 0;
+}
+
+// decodes the records of task into chunk, a run at a time with memset.
+// Returns the number of records read.
+long decode_records(Task *task, Chunk *chunk) {
+  chunk_reserve(chunk, task->length);
+  unsigned char *out = chunk->buff;
+  unsigned char *out_end = chunk->buff + task->length;
+  long skip = task->skip, records = 0;
+  Token token;
+  for (char *record = task->read_begin;
+       out < out_end &&
+       read_token(record, task->read_end, task->compact, &token);
+       record += token.size, records++) {
+    long run = token.run;
+    if (run <= skip) {
+      skip -= run;
+      continue;
+    }
+    run -= skip;
+    if (run > out_end - out)
+      run = out_end - out;
+    if (token.literal)
+      memcpy(out, token.data + skip, run);
+    else
+      memset(out, *token.data, run);
+    skip = 0;
+    out += run;
+  }
+  // Only a bad index leaves the chunk short, don't write out old bytes.
+  memset(out, 0, out_end - out);
+  chunk->buff_begin = 0;
+  chunk->buff_index = task->length;
+  if (USE_PWRITE) {
+    // Chunks can land in any order, the writer only keeps them bounded.
+    if (pwrite_all(chunk->buff, task->length, OUTPUT_BASE + task->offset))
+      atomic_store(&PWRITE_ERROR, 1);
+    chunk->buff_index = 0;
+  }
+  return records;
+}
+
+/*
+ * Workers can write their own chunks when stdout is a regular file, as every
+ * chunk knows where it goes. Appending files need the ordered writer.
+ */
+int use_pwrite() {
+  struct stat sb;
+  char *mode = getenv(OUTPUT_MODE);
+  if (mode && strcmp(mode, "pwrite"))
+    return 0;
+  if (fstat(STDOUT_FILENO, &sb) == -1 || !S_ISREG(sb.st_mode))
+    return 0;
+  if (fcntl(STDOUT_FILENO, F_GETFL) & O_APPEND)
+    return 0;
+  OUTPUT_BASE = lseek(STDOUT_FILENO, 0, SEEK_CUR);
+  return OUTPUT_BASE != -1;
+}
+
+/*
+ * Parses a range of the form begin:end, where either may be left out. A
+ * negative begin counts back from the end of the output. Returns 0 if
+ * successful.
+ */
+int parse_range(char *range) {
+  char *rest;
+  RANGE_GIVEN = 1;
+  if (*range != ':') {
+    RANGE_BEGIN = strtol(range, &rest, 10);
+    if (rest == range)
+      return 1;
+    range = rest;
+  }
+  if (*range++ != ':')
+    return 1;
+  if (*range) {
+    RANGE_END = strtol(range, &rest, 10);
+    if (*rest || RANGE_END < 0)
+      return 1;
+  }
+  RANGE_FROM_END = RANGE_BEGIN < 0;
+  if (RANGE_FROM_END) {
+    RANGE_BEGIN = -RANGE_BEGIN;
+    // Both ends count from the start once the length is known.
+    return RANGE_END != LONG_MAX;
+  }
+  return RANGE_END < RANGE_BEGIN;
+}
+
+int main(int argc, char **argv) {
+  int opt;
+  while ((opt = getopt(argc, argv, "r:")) != -1) {
+    if (opt != 'r' || parse_range(optarg)) {
+      fprintf(stderr, "punzip: [-r begin:end] file1 [file2 ...]\n");
+      return 1;
+    }
+  }
+  // The range is over the output of one file.
+  if (optind == argc || (RANGE_GIVEN && argc - optind > 1)) {
+    fprintf(stderr, "punzip: [-r begin:end] file1 [file2 ...]\n");
+    return 1;
+  } else {
+    // GET THREAD COUNT
+    char *given_thread_count = getenv(NTHREADS);
+    int concurrent_task_num = given_thread_count ? atoi(given_thread_count) : 1;
+    if (concurrent_task_num < 1) {
+      fprintf(stderr, "%s must be a positive integer\n", NTHREADS);
+      exit(1);
+    }
+
+    USE_PWRITE = use_pwrite();
+    atomic_init(&PWRITE_ERROR, 0);
+    Pipeline pipeline = {split_records, decode_records, NULL, NULL,
+                         RECORD_SIZE};
+    // run_pipeline skips the program name, like argv.
+    int out = run_pipeline(&pipeline, argv + optind - 1, argc - optind + 1,
+                           concurrent_task_num);
+    if (USE_PWRITE) {
+      // Leave stdout after the output, as if it had been written in order.
+      long end = OUTPUT_OFFSET < RANGE_END ? OUTPUT_OFFSET : RANGE_END;
+      end = end > RANGE_BEGIN ? end - RANGE_BEGIN : 0;
+      lseek(STDOUT_FILENO, OUTPUT_BASE + end, SEEK_SET);
+      if (atomic_load(&PWRITE_ERROR))
+        out = 1;
+    }
+    return out;
+  }
+}
@@ -1,375 +1,342 @@
-#include <assert.h>
-#include <fcntl.h>
-#include <pthread.h>
-#include <signal.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <sys/mman.h>
-#include <sys/stat.h>
-#include <unistd.h>
+#include "format.h"
+#include "pipeline.h"
 
-const int INT_OFFSET = 4;
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/uio.h>
 
-#ifndef DEBUG_INFO
-const unsigned int __DEBUG_INFO = 0;
-#define DEBUG_INFO
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAS_X86_SIMD
 #endif
 
-#define eprintf(priority, ...)                                                 \
-  if (priority <= __DEBUG_INFO)                                                \
-  fprintf(stderr, __VA_ARGS__)
+const int THREAD_BUFF_LENGTH = 1 << 16;
 
-const int CHUNK_SIZE = 9000; // NOTE: be carful with this buffer size
-const int THREAD_BUFF_LENGTH = CHUNK_SIZE * 10;
+const char *SCAN_MODE =
+    "PZIP_SCAN"; // Set to "scalar", "sse2" or "avx2" to force a run scanner.
+const char *FORMAT =
+    "PZIP_FORMAT"; // Set to "framed" or "compact", see format.h
 
-const char *NTHREADS =
-    "NTHREADS"; // The name of the variable for setting threads.
-
-typedef struct {
-  volatile int write_num;
-  pthread_mutex_t
-      guard; // A semiphore would have been better, but not supported on mac.
-} WriteHead;
+int FRAMED;  // Set if writing the framed format.
+int COMPACT; // Set if writing the compact format.
 
-WriteHead WRITE_HEAD;
+CompressInfo PENDING_INFO; // The last run written, held back so it can be
+                           // merged with the first run of the next chunk.
 
 /*
- * Setup write-head.
+ * Adds the records of chunk to iov, returning the number of bytes added.
+ *
+ * The final record of the chunk is not added, but kept in PENDING_INFO. If the
+ * chunk starts with the same char the two runs are merged, otherwise the
+ * pending run is written into the chunk's headroom.
  */
-void write_head_init() {
-  WRITE_HEAD.write_num = 1;
-  pthread_mutex_init(&WRITE_HEAD.guard, NULL);
+int gather_records(Chunk *chunk, struct iovec *iov) {
+  CompressInfo *pending = &PENDING_INFO;
+  unsigned char *begin = chunk->buff + chunk->buff_begin;
+  unsigned char *end = chunk->buff + chunk->buff_index;
+  if (end == begin)
+    return 0;
+  int first_count = read_record_count(begin);
+  if (pending->count > 0) {
+    if ((char)begin[INT_OFFSET] == pending->last_char &&
+        first_count <= INT_MAX - pending->count)
+      write_record(begin, pending->last_char, first_count + pending->count);
+    else
+      write_record(begin -= RECORD_SIZE, pending->last_char, pending->count);
+  }
+  end -= RECORD_SIZE;
+  pending->count = read_record_count(end);
+  pending->last_char = end[INT_OFFSET];
+  iov->iov_base = begin;
+  iov->iov_len = end - begin;
+  return end - begin;
 }
 
-/*
- * Locks the write-head, returning a pointer to the write position.
- * This pointer should be updated on write.
- */
-void write_head_lock() {
-  pthread_mutex_lock(&WRITE_HEAD.guard);
-  eprintf(3, "WRITE_HEAD locked\n");
+void write_pending_info() {
+  CompressInfo *pending = &PENDING_INFO;
+  if (pending->count > 0) {
+    unsigned char record[RECORD_SIZE];
+    write_record(record, pending->last_char, pending->count);
+    struct iovec iov = {record, RECORD_SIZE};
+    write_head_write(&iov, 1);
+    pending->count = 0;
+  }
 }
 
-void write_head_unlock() {
-  pthread_mutex_unlock(&WRITE_HEAD.guard);
-  eprintf(3, "WRITE_HEAD unlocked\n");
-}
+/*
+ * The index of the framed format, built by the writer thread as it gathers
+ * blocks.
+ */
+typedef struct {
+  IndexEntry *entries;
+  long length;
+  long capacity;
+  uint64_t decoded_length; // The decoded bytes of every block so far.
+  uint64_t written;        // The bytes written so far.
+} FrameIndex;
 
-int write_head_num() { return WRITE_HEAD.write_num; }
+FrameIndex FRAME_INDEX;
 
 /*
- * Writes the buff to head.
- * Assumes that the write-head is already locked.
+ * Adds a whole block to iov, noting it in the FRAME_INDEX.
  */
-void write_head_write_buff(unsigned char *buff, int length) {
-  if (length > 0)
-    fwrite(buff, length, 1, stdout);
-  WRITE_HEAD.write_num++;
-  eprintf(3, "Written %d chars.\n", length);
+int gather_block(Chunk *chunk, struct iovec *iov) {
+  if (chunk->buff_index == chunk->buff_begin)
+    return 0;
+  FrameIndex *index = &FRAME_INDEX;
+  if (index->length == index->capacity) {
+    index->capacity = index->capacity ? index->capacity * 2 : 64;
+    index->entries = (IndexEntry *)realloc(
+        index->entries, sizeof(IndexEntry) * index->capacity);
+    assert(index->entries != NULL);
+  }
+  IndexEntry *entry = index->entries + index->length++;
+  entry->decoded_offset = index->decoded_length;
+  entry->offset = index->written;
+  entry->records = read_le(chunk->buff, 4);
+  index->decoded_length += read_le(chunk->buff + 4, 4);
+  index->written += chunk->buff_index;
+  iov->iov_base = chunk->buff;
+  iov->iov_len = chunk->buff_index;
+  return chunk->buff_index;
 }
 
-typedef struct {
-  char last_char;
-  int count;
-  int buff_index;
-  unsigned char buff[THREAD_BUFF_LENGTH];
-} CompressInfo;
-
-void compress_info_init(CompressInfo *info) {
-  info->last_char = EOF;
-  info->count = 0;
-  info->buff_index = 0;
+/*
+ * Ends the blocks, then writes the index and footer.
+ */
+void write_frame_index() {
+  FrameIndex *index = &FRAME_INDEX;
+  long length =
+      BLOCK_HEADER_SIZE + INDEX_ENTRY_SIZE * index->length + FOOTER_SIZE;
+  unsigned char *buff = (unsigned char *)calloc(length, 1);
+  assert(buff != NULL);
+  unsigned char *entry = buff + BLOCK_HEADER_SIZE;
+  for (long i = 0; i < index->length; i++, entry += INDEX_ENTRY_SIZE)
+    write_index_entry(entry, index->entries + i);
+  write_le(entry, index->length, 8);
+  write_le(entry + 8, index->decoded_length, 8);
+  memcpy(entry + 16, FRAME_MAGIC, FRAME_MAGIC_SIZE);
+  struct iovec iov = {buff, length};
+  write_head_write(&iov, 1);
+  free(buff);
+  free(index->entries);
 }
 
-typedef struct {
-  int tasknum;          // The sequential ordering of writes, starting from 1.
-  char *read_begin;     // The begininning of the sequence to encode.
-  char *read_end;       // The end of the sequence to decode.
-  CompressInfo info;    // Information about the decoding taking place.
-  int exit_immediately; // Whither to exit after finishing one cycle.
-  int write_end; // Whither to write the end, or wait for new input to encode.
-  int return_tasknum; // The tasknum to next write to.
-  pthread_t thread;
-} TaskDescriptor;
-
-void task_descriptor_init(TaskDescriptor *task) {
-  task->tasknum = 0;
-  task->read_end = NULL;
-  task->read_begin = NULL;
-  task->exit_immediately = 0;
-  task->write_end = 0;
-  task->return_tasknum = -1;
-  compress_info_init(&task->info);
+// writes the start of the framed format, returning 0 if successful.
+int frame_index_init() {
+  FRAME_INDEX.entries = NULL;
+  FRAME_INDEX.length = 0;
+  FRAME_INDEX.capacity = 0;
+  FRAME_INDEX.decoded_length = 0;
+  FRAME_INDEX.written = FRAME_MAGIC_SIZE;
+  struct iovec iov = {(void *)FRAME_MAGIC, FRAME_MAGIC_SIZE};
+  return write_all(&iov, 1);
 }
+
 void eprint_write_buff(unsigned char *buf, int length) {
   eprintf(3, "buf: '");
-  for (int len = 0; len < length; len += sizeof(int) + 1) {
-    int n = (*(buf + len) << 0) + (*(buf + len + 1) << 8) +
-            (*(buf + len + 2) << 16) + (*(buf + len + 3) << 24);
-    eprintf(3, "%d%c", n, *(buf + len + sizeof(int)));
+  for (int len = 0; len < length; len += RECORD_SIZE) {
+    eprintf(3, "%d%c", read_record_count(buf + len), *(buf + len + INT_OFFSET));
   }
   eprintf(3, "'\n");
 }
 
-void write_internal_buff(unsigned char *buff, int *index, char c, int count) {
-  if (count > 0) {
-    if (*index > 1 && buff[*index - 1] == c) {
-      count = count + (buff[*index - 2] << 24 & 0xFF) +
-              (buff[*index - 3] << 16 & 0xFF) + (buff[*index - 4] << 8 & 0xFF) +
-              (buff[*index - 5] << 0 & 0xFF);
-      *index -= 5;
-    }
-    unsigned char *ind = buff + *index;
-    *index += sizeof(int) + 1;
-    assert(*index >= 0 && *index < THREAD_BUFF_LENGTH);
-    ind[3] = (count >> 24) & 0xFF;
-    ind[2] = (count >> 16) & 0xFF;
-    ind[1] = (count >> 8) & 0xFF;
-    ind[0] = count & 0xFF;
-    ind[4] = c;
-    eprintf(6, "Writing internal '%d%c'\n", count, c == '\n' ? '@' : c);
+/*
+ * Run scanners return the first position in [begin, end) that is not c, or
+ * end if there is none.
+ */
+typedef char *(*RunScanner)(char *begin, char *end, char c);
+
+char *scan_run_scalar(char *begin, char *end, char c) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  // Compare a word at a time, the lowest differing byte is the first one.
+  uint64_t pattern = 0x0101010101010101ULL * (unsigned char)c;
+  for (; end - begin >= 8; begin += 8) {
+    uint64_t word;
+    memcpy(&word, begin, 8);
+    if (word != pattern)
+      return begin + __builtin_ctzll(word ^ pattern) / 8;
   }
+#endif
+  while (begin < end && *begin == c)
+    begin++;
+  return begin;
 }
 
-void sync_write_from_internal_buff(TaskDescriptor *desc) {
-  int do_loop = 1;
-  while (do_loop) {
-    write_head_lock(); // TODO: streamline concurency
-    assert(desc->tasknum >= write_head_num());
-    eprintf(3, "Attempting do-loop of task %d on write_head %d\n",
-            desc->tasknum, write_head_num());
-    if (desc->tasknum == write_head_num()) {
-      if (!desc->write_end) {
-        write_head_write_buff(desc->info.buff, desc->info.buff_index);
-        desc->info.buff_index = 0;
-      } else {
-        desc->return_tasknum = desc->tasknum;
-      }
-      do_loop = 0;
-      desc->tasknum = 0;
-    } else
-      eprintf(5, "no action loop: tasknum %d on headnum %d for thread %lu\n",
-              desc->tasknum, write_head_num(), (long)desc->thread);
-    write_head_unlock();
-    eprintf(3, "spin baby spin\n");
+#ifdef HAS_X86_SIMD
+__attribute__((target("sse2"))) char *scan_run_sse2(char *begin, char *end,
+                                                     char c) {
+  __m128i pattern = _mm_set1_epi8(c);
+  for (; end - begin >= 16; begin += 16) {
+    __m128i block = _mm_loadu_si128((__m128i *)begin);
+    unsigned int differ =
+        _mm_movemask_epi8(_mm_cmpeq_epi8(block, pattern)) ^ 0xFFFF;
+    if (differ)
+      return begin + __builtin_ctz(differ);
   }
+  return scan_run_scalar(begin, end, c);
 }
-// reads the range described by desc into buff, returning the length read of the
-// buff read.
-void read_to_internal_buff(TaskDescriptor *desc) {
-  char c = EOF;
-  while (desc->read_end > desc->read_begin) {
-    c = *((desc->read_begin)++);
-    if (c == desc->info.last_char) {
-      (desc->info.count)++;
-    } else {
-      write_internal_buff(desc->info.buff, &desc->info.buff_index,
-                          desc->info.last_char, desc->info.count);
-      desc->info.last_char = c;
-      desc->info.count = 1;
-    }
+
+__attribute__((target("avx2"))) char *scan_run_avx2(char *begin, char *end,
+                                                     char c) {
+  __m256i pattern = _mm256_set1_epi8(c);
+  for (; end - begin >= 32; begin += 32) {
+    __m256i block = _mm256_loadu_si256((__m256i *)begin);
+    unsigned int differ =
+        ~(unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, pattern));
+    if (differ)
+      return begin + __builtin_ctz(differ);
   }
-  write_internal_buff(desc->info.buff, &desc->info.buff_index,
-                      desc->info.last_char, desc->info.count);
-  desc->info.last_char = EOF;
-  desc->info.count = 0;
+  return scan_run_sse2(begin, end, c);
 }
+#endif
 
-void write_section(TaskDescriptor *desc) {
-  int had_exit_immediatly = 0;
-  do {
-    assert(had_exit_immediatly == 0);
-    assert(desc->exit_immediately == 0 || desc->exit_immediately == 1);
-    if (desc->tasknum) { // TODO: put in non spin-lock here
-      eprintf(2, "executing task_num=%d with write_end=%d on thread %lu\n",
-              desc->tasknum, desc->write_end, (long)desc->thread);
-      read_to_internal_buff(desc);
-
-      eprintf(2, "finished read task_num=%d with write_end=%d on thread %lu\n",
-              desc->tasknum, desc->write_end, (long)desc->thread);
-      sync_write_from_internal_buff(desc);
-      eprintf(2,
-              "finished write section loop:\n\ttask_num=%d with write_end=%d "
-              "on thread %lu\n",
-              desc->tasknum, desc->write_end, (long)desc->thread);
-      eprintf(2, "note: desc->exit_immediately=%d\n", desc->exit_immediately);
-    }
-    eprintf(5, "spin the write section\n");
-    had_exit_immediatly |= desc->exit_immediately;
-  } while (!desc->exit_immediately);
-  assert(desc->exit_immediately);
+RunScanner scan_run = scan_run_scalar;
+
+/*
+ * Picks the widest run scanner this cpu supports, unless SCAN_MODE asks for a
+ * particular one.
+ */
+void scan_run_init() {
+  scan_run = scan_run_scalar;
+#ifdef HAS_X86_SIMD
+  char *mode = getenv(SCAN_MODE);
+  __builtin_cpu_init();
+  if (mode && !strcmp(mode, "scalar"))
+    return;
+  if (__builtin_cpu_supports("sse2"))
+    scan_run = scan_run_sse2;
+  if (mode && !strcmp(mode, "sse2"))
+    return;
+  if (__builtin_cpu_supports("avx2"))
+    scan_run = scan_run_avx2;
+#endif
 }
 
-// mmap a file into memeory,
-// setting file to the file,
-// setting length to the file length
-// returning 0 if successful
-int mmap_file(char *file_name, char **file, size_t *length) {
-  struct stat sb;
-  int fd = open(file_name, O_RDONLY);
-  if (fd == -1)
-    return 1;
-  int fstat_code = fstat(fd, &sb);
-  if (fstat_code == -1)
-    return 2;
-  *file = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
-  if (*file == MAP_FAILED)
-    return 3;
-  *length = sb.st_size;
-  return 0;
+void write_internal_buff(Chunk *chunk, char c, int count) {
+  if (count > 0) {
+    if (chunk->buff_index + RECORD_SIZE > chunk->buff_length) {
+      chunk_reserve(chunk, chunk->buff_length ? chunk->buff_length * 2
+                                              : THREAD_BUFF_LENGTH);
+    }
+    write_record(chunk->buff + chunk->buff_index, c, count);
+    chunk->buff_index += RECORD_SIZE;
+    eprintf(6, "Writing internal '%d%c'\n", count, c == '\n' ? '@' : c);
+  }
 }
 
-// returns if the batch was the last in the file.
-int set_next_task(int *task_num, TaskDescriptor *task, char **head, char *end,
-                  int use_pending_info, CompressInfo *pending_info) {
-  if (*head >= end) {
-    return 0;
+// reads the range described by task into chunk, after RECORD_SIZE bytes of
+// headroom for gather_records, or a block header if FRAMED. Returns the number
+// of records written.
+long read_to_internal_buff(Task *task, Chunk *chunk) {
+  char *read_begin = task->read_begin;
+  chunk->buff_begin = chunk->buff_index =
+      FRAMED ? BLOCK_HEADER_SIZE : RECORD_SIZE;
+  while (task->read_end > read_begin) {
+    char c = *read_begin;
+    char *run_end = read_begin + 1;
+    // Most runs in text are a single char, so check before calling out.
+    if (run_end < task->read_end && *run_end == c)
+      run_end = scan_run(run_end, task->read_end, c);
+    size_t count = run_end - read_begin;
+    for (; count > INT_MAX; count -= INT_MAX)
+      write_internal_buff(chunk, c, INT_MAX);
+    write_internal_buff(chunk, c, count);
+    read_begin = run_end;
   }
-  assert(task->exit_immediately == 0 || task->exit_immediately == 1);
-  task->read_begin = *head;
-  char *seek = *head + CHUNK_SIZE;
-  // don't seek past the then
-  if (end < seek)
-    seek = end;
-  // don't break a section into diffrent tasks
-  while (seek + 1 < end && *seek == *(seek + 1))
-    seek++;
-  if (seek < end)
-    seek++;
-  *head = (task->read_end = seek);
-  int incr_task_num = !task->write_end; // from old run
-  task->write_end = task->read_end == end;
-  int out = task->read_end == end;
-  // This triggers action, so must happen last
-  int tasknum = (*(task_num) += incr_task_num);
-  if (use_pending_info) {
-    task->info = *pending_info;
-    eprintf(3, "Info switch made to buff with length %d\n",
-            pending_info->buff_index);
+  long records = (chunk->buff_index - chunk->buff_begin) / RECORD_SIZE;
+  if (FRAMED && records > 0) {
+    write_le(chunk->buff, records, 4);
+    write_le(chunk->buff + 4, task->read_end - task->read_begin, 4);
+    chunk->buff_begin = 0;
   }
-  eprintf(3, "Task assigned to thread %d=%lu with", tasknum,
-          (long)task->thread);
-  eprintf(3, " head set to offset %ld\n", (long)(end - *head));
-  task->tasknum = tasknum;
-  return out;
+  return records;
 }
 
-int process_files(char **fnames, int flength, TaskDescriptor *tasks,
-                  int ntasks) {
-
-  int last_task = 0; // -1 means info is pending, otherwise it indexes into
-                     // the appropriate task.
-  CompressInfo pending_info;
-
-  for (int i = 0; i < ntasks; i++)
-    assert(tasks[i].exit_immediately == 0 || tasks[i].exit_immediately == 1);
-
-  // PROCESS FILES
-  int task_num = 0;
-  for (int file_i = 1; file_i < flength; file_i++) {
-    char *file, *findex, *end;
-    size_t length;
-
-    if (mmap_file(fnames[file_i], &file, &length))
-      return (1);
-    findex = file;
-    end = file + length;
-    int exit = 0;
-    // file is not yet processed
-    while (end > findex && !exit) {
-      for (int task_i = 0; task_i < ntasks; task_i++) {
-        assert(tasks[task_i].exit_immediately == 0 ||
-               tasks[task_i].exit_immediately == 1);
-
-        if (tasks[task_i].tasknum == 0) {
-          exit = set_next_task(&task_num, tasks + task_i, &findex, end,
-                               last_task == -1, &pending_info);
-          if (exit) {
-            last_task = task_i;
-          }
-        }
-      }
-      write_section(tasks + 0); // this one returns on completion
-    }
-    munmap(file, length);
-    while (tasks[last_task].tasknum) {
-      write_section(tasks + 0); // NOTE: Spin lock
-      eprintf(2,
-              "waiting on last_task=%d, "
-              "tasknum=%d with headnum=%d on thread %lu, exit_immediately=%d\n",
-              last_task, tasks[last_task].tasknum, write_head_num(),
-              (long)tasks[last_task].thread, tasks[last_task].exit_immediately);
-      eprintf(2,
-              "main thread "
-              "tasknum=%d with headnum=%d on thread %lu\n",
-              tasks[0].tasknum, write_head_num(), (long)tasks[0].thread);
-    }
-    pending_info = tasks[last_task].info; // save the info of the last task.
-    last_task = -1;
+// makes room in chunk for length more bytes.
+void chunk_make_room(Chunk *chunk, int length) {
+  if (chunk->buff_index + length > chunk->buff_length) {
+    int grown = chunk->buff_length ? chunk->buff_length * 2 : THREAD_BUFF_LENGTH;
+    chunk_reserve(chunk, chunk->buff_index + length > grown
+                             ? chunk->buff_index + length
+                             : grown);
   }
-  eprintf(2, "Begun cleanup\n");
+}
 
-  // Finish when done
-  for (int i = 0; i < ntasks; i++) {
-    tasks[i].tasknum = tasks[i].write_end ? tasks[i].return_tasknum : 0;
-    tasks[i].write_end = 0;
-    tasks[i].exit_immediately = 1;
-  }
-  // Join
-  eprintf(2, "Joining threads\n");
-  for (int i = 1; i < ntasks; i++) {
-    write_section(tasks + 0); // this one returns on completion
-    eprintf(2,
-            "about to join thread: %lu\n"
-            "\ttasknum=%d, write_end=%d\n"
-            "\theadnum=%d, exit_immediatly=%d\n"
-            "\tinfo.count=%d, into.buff_index=%d\n",
-            (long)tasks[i].thread, tasks[i].tasknum, tasks[i].write_end,
-            write_head_num(), tasks[i].exit_immediately, tasks[i].info.count,
-            tasks[i].info.buff_index);
-    for (int k = 0; k < ntasks; k++) {
-      if (k != i)
-        eprintf(2,
-                "\n"
-                "\texamining thread: %lu\n"
-                "\t\ttasknum=%d, write_end=%d\n"
-                "\t\theadnum=%d, exit_immediatly=%d\n"
-                "\t\tinfo.count=%d, into.buff_index=%d\n",
-                (long)tasks[k].thread, tasks[k].tasknum, tasks[k].write_end,
-                write_head_num(), tasks[k].exit_immediately,
-                tasks[k].info.count, tasks[k].info.buff_index);
-    }
-    pthread_join(tasks[i].thread, NULL);
-    eprintf(2, "thread %lu joined\n", (long)tasks[i].thread);
+// writes [begin, end) as a literal token, returning the number of tokens
+// written.
+int write_literal_token(Chunk *chunk, char *begin, char *end) {
+  if (end > begin) {
+    chunk_make_room(chunk, MAX_VARINT_SIZE + (end - begin));
+    chunk->buff_index += write_varint(chunk->buff + chunk->buff_index,
+                                      (uint64_t)(end - begin) << 1 | 1);
+    memcpy(chunk->buff + chunk->buff_index, begin, end - begin);
+    chunk->buff_index += end - begin;
+    return 1;
   }
-  write_section(tasks + 0); // this one returns on completion
   return 0;
 }
 
-TaskDescriptor *setup_tasks(int ntasks) {
+void write_run_token(Chunk *chunk, char c, size_t count) {
+  chunk_make_room(chunk, MAX_VARINT_SIZE + 1);
+  chunk->buff_index +=
+      write_varint(chunk->buff + chunk->buff_index, (uint64_t)count << 1);
+  chunk->buff[chunk->buff_index++] = c;
+}
 
-  // INITIALIZE TASKS
-  TaskDescriptor *tasks =
-      (TaskDescriptor *)malloc(sizeof(TaskDescriptor) * ntasks + 1);
-  assert(tasks != NULL);
-  for (int i = 0; i < ntasks; i++) {
-    task_descriptor_init(tasks + i);
-    assert(tasks[i].exit_immediately == 0);
+// reads the range described by task into chunk as compact tokens. Runs too
+// short to be worth a token are gathered into literals. Returns the number of
+// tokens written.
+long read_to_compact_buff(Task *task, Chunk *chunk) {
+  char *read_begin = task->read_begin;
+  char *literal = read_begin;
+  long tokens = 0;
+  chunk->buff_begin = chunk->buff_index = 0;
+  while (task->read_end > read_begin) {
+    char c = *read_begin;
+    char *run_end = read_begin + 1;
+    if (run_end < task->read_end && *run_end == c)
+      run_end = scan_run(run_end, task->read_end, c);
+    if (run_end - read_begin >= COMPACT_MIN_RUN) {
+      tokens += write_literal_token(chunk, literal, read_begin);
+      write_run_token(chunk, c, run_end - read_begin);
+      tokens++;
+      literal = run_end;
+    }
+    read_begin = run_end;
   }
-  tasks[0].exit_immediately = 1;
-
-  // INITIALIZE THREADS
-  pthread_attr_t pattr;
-  pthread_attr_init(&pattr);
-  tasks[0].thread = 0;
-  for (int i = 1; i < ntasks; i++) {
-    if (pthread_create(&(tasks + i)->thread, &pattr, (void *)write_section,
-                       (tasks) + i))
-      exit(1);
-    assert(tasks[i].exit_immediately == 0 || tasks[i].exit_immediately == 1);
+  return tokens + write_literal_token(chunk, literal, task->read_end);
+}
+
+// sets task to the next chunk of the file, advancing head past it.
+void set_next_task(int *task_num, Task *task, char **head, char *end) {
+  assert(*head < end);
+  task->read_begin = *head;
+  long size = chunk_sizer_next();
+  // don't seek past the then
+  char *seek = end - *head < size ? end : *head + size;
+  // don't break a section into diffrent tasks, unless blocks are independent
+  if (seek < end && !FRAMED)
+    seek = scan_run(seek, end, *(seek - 1));
+  *head = (task->read_end = seek);
+  task->tasknum = ++(*task_num);
+  eprintf(3, "Task %d assigned with head set to offset %ld\n", task->tasknum,
+          (long)(end - *head));
+}
+
+// splits all of input into tasks. Runs that cross inputs, or buffers of a
+// streamed input, are merged by gather_records unless FRAMED.
+int split_input(MappedFile *input, int *task_num) {
+  char *findex = input->file;
+  char *end = input->file + input->length;
+  while (end > findex) {
+    Task task;
+    set_next_task(task_num, &task, &findex, end);
+    task.source = input;
+    submit_task(&task);
   }
-  return tasks;
+  return 0;
 }
 
 int main(int argc, char **argv) {
@@ -377,26 +344,44 @@ int main(int argc, char **argv) {
     printf("pzip: file1 [file2 ...]\n");
     return 1;
   } else {
-    // Note: the main thread handles task[0]
-    // SETUP HEAD
-    write_head_init();
+    // Note: the main thread splits files into tasks, the worker threads encode
+    // them, and the write head's thread writes them.
 
     // GET THREAD COUNT
     char *given_thread_count = getenv(NTHREADS);
     int concurrent_task_num = given_thread_count ? atoi(given_thread_count) : 1;
     if (concurrent_task_num < 1) {
-      printf("%s must be a positive integer\n", NTHREADS);
+      fprintf(stderr, "%s must be a positive integer\n", NTHREADS);
       exit(1);
     }
 
-    TaskDescriptor *tasks = setup_tasks(concurrent_task_num);
-    for (int i = 0; i < concurrent_task_num; i++)
-      assert(tasks[i].exit_immediately == 0 || tasks[i].exit_immediately == 1);
-    // Joins threads, to tasks can now be freed.
-    int out = process_files(argv, argc, tasks, concurrent_task_num);
+    char *format = getenv(FORMAT);
+    FRAMED = format && !strcmp(format, "framed");
+    COMPACT = format && !strcmp(format, "compact");
+    if (format && !FRAMED && !COMPACT) {
+      fprintf(stderr, "%s must be \"framed\" or \"compact\" if set\n", FORMAT);
+      exit(1);
+    }
 
-    // cleanup
-    free(tasks);
-    return out;
+    scan_run_init();
+    compress_info_init(&PENDING_INFO);
+    Pipeline pipeline = {split_input, read_to_internal_buff, gather_records,
+                         write_pending_info, 1};
+    if (FRAMED) {
+      if (frame_index_init())
+        return 1;
+      pipeline.gather = gather_block;
+      pipeline.finish = write_frame_index;
+    } else if (COMPACT) {
+      // Tokens are not merged between chunks, the output only gets a little
+      // longer where a literal or run crosses one.
+      struct iovec iov = {(void *)COMPACT_MAGIC, FRAME_MAGIC_SIZE};
+      if (write_all(&iov, 1))
+        return 1;
+      pipeline.run_task = read_to_compact_buff;
+      pipeline.gather = NULL;
+      pipeline.finish = NULL;
+    }
+    return run_pipeline(&pipeline, argv, argc, concurrent_task_num);
   }
 }
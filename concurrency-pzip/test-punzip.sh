@@ -0,0 +1,8 @@
+#! /bin/bash
+
+if ! [[ -x punzip ]]; then
+    echo "punzip executable does not exist"
+    exit 1
+fi
+
+../tester/run-tests.sh -d punzip-tests $*
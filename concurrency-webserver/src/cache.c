@@ -0,0 +1,320 @@
+#include "cache.h"
+#include <stdatomic.h>
+#include <sys/resource.h>
+
+//
+// The cache is split into shards by the hash of the path, each with its
+// own lock, hash table, LRU list and share of the memory budget, so workers
+// looking up different files rarely wait for each other.
+//
+
+#define CACHE_SHARDS (16)
+#define CACHE_BUCKETS (64)        // hash buckets per shard
+#define CACHE_SHARD_ENTRIES (64)
+#define CACHE_MAX_INLINE (1 << 18) // larger files are sent from a pinned fd
+#define CACHE_MAX_PINNED (4096)    // fds pinned across all shards, at most a
+                                   // quarter of the process's fd limit
+
+typedef struct {
+    pthread_mutex_t lock;
+    cache_entry_t *buckets[CACHE_BUCKETS];
+    cache_entry_t *lru_head;      // most recently used
+    cache_entry_t *lru_tail;
+    size_t bytes;
+    int entries;
+} cache_shard_t;
+
+static cache_shard_t shards[CACHE_SHARDS];
+static size_t shard_budget = 0;   // 0 if the cache is off
+static int revalidate_after = 0;  // ms
+static atomic_int pinned;         // fds held by entries, linked or not
+static int pinned_limit = 0;
+
+void cache_init(size_t budget, int revalidate_ms) {
+    for (int i = 0; i < CACHE_SHARDS; i++)
+	pthread_mutex_init_or_die(&shards[i].lock);
+    shard_budget = budget / CACHE_SHARDS;
+    revalidate_after = revalidate_ms;
+    // the rest of the fds are left for connections and the files they send
+    struct rlimit limit;
+    atomic_init(&pinned, 0);
+    pinned_limit = CACHE_MAX_PINNED;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY &&
+	limit.rlim_cur / 4 < CACHE_MAX_PINNED)
+	pinned_limit = limit.rlim_cur / 4;
+}
+
+static unsigned long cache_hash(char *path) {
+    // FNV-1a
+    unsigned long hash = 14695981039346656037UL;
+    for (; *path; path++)
+	hash = (hash ^ (unsigned char) *path) * 1099511628211UL;
+    return hash;
+}
+
+static long cache_now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static cache_shard_t *cache_shard(unsigned long hash) {
+    return &shards[hash % CACHE_SHARDS];
+}
+
+static void cache_free(cache_entry_t *entry) {
+    if (entry->fd >= 0) {
+	close_or_die(entry->fd);
+	atomic_fetch_sub(&pinned, 1);
+    }
+    free(entry->data);
+    free(entry->header);
+    free(entry->path);
+    free(entry);
+}
+
+static void cache_lru_unlink(cache_shard_t *shard, cache_entry_t *entry) {
+    if (entry->lru_prev)
+	entry->lru_prev->lru_next = entry->lru_next;
+    else
+	shard->lru_head = entry->lru_next;
+    if (entry->lru_next)
+	entry->lru_next->lru_prev = entry->lru_prev;
+    else
+	shard->lru_tail = entry->lru_prev;
+}
+
+static void cache_lru_push(cache_shard_t *shard, cache_entry_t *entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = shard->lru_head;
+    if (shard->lru_head)
+	shard->lru_head->lru_prev = entry;
+    else
+	shard->lru_tail = entry;
+    shard->lru_head = entry;
+}
+
+//
+// Takes the entry out of the shard, which must be locked. It is freed once
+// the last user releases it. Returns whether that was already the case.
+//
+static int cache_unlink(cache_shard_t *shard, cache_entry_t *entry) {
+    cache_entry_t **p = &shard->buckets[entry->hash / CACHE_SHARDS % CACHE_BUCKETS];
+    while (*p != entry)
+	p = &(*p)->next;
+    *p = entry->next;
+    cache_lru_unlink(shard, entry);
+    shard->bytes -= entry->cost;
+    shard->entries--;
+    entry->linked = 0;
+    return --entry->refs == 0;
+}
+
+static cache_entry_t *cache_find(cache_shard_t *shard, unsigned long hash, char *path) {
+    cache_entry_t *entry = shard->buckets[hash / CACHE_SHARDS % CACHE_BUCKETS];
+    while (entry != NULL && (entry->hash != hash || strcmp(entry->path, path)))
+	entry = entry->next;
+    return entry;
+}
+
+static int cache_same_time(struct timespec a, struct timespec b) {
+    return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+//
+// Returns whether the file is still the one the entry was made from. The
+// times are compared to the nanosecond, so a write in the same second as
+// the last one still shows, and ctime catches a write that put mtime back.
+//
+static int cache_current(cache_entry_t *entry) {
+    struct stat sbuf;
+    return stat(entry->path, &sbuf) == 0 && sbuf.st_dev == entry->dev &&
+	sbuf.st_ino == entry->ino && cache_same_time(sbuf.st_mtim, entry->mtime) &&
+	cache_same_time(sbuf.st_ctim, entry->ctime) && sbuf.st_size == entry->size;
+}
+
+void cache_release(cache_entry_t *entry) {
+    cache_shard_t *shard = cache_shard(entry->hash);
+    pthread_mutex_lock_or_die(&shard->lock);
+    int last = --entry->refs == 0;
+    pthread_mutex_unlock_or_die(&shard->lock);
+    if (last)
+	cache_free(entry);
+}
+
+//
+// Looks up the file at path, returning its entry (to be released with
+// cache_release) or NULL if it is not cached. The file is only stat'ed
+// again once the revalidation interval has passed since the last time;
+// an entry for a file that has changed is dropped.
+//
+cache_entry_t *cache_get(char *path) {
+    if (shard_budget == 0)
+	return NULL;
+    unsigned long hash = cache_hash(path);
+    cache_shard_t *shard = cache_shard(hash);
+    
+    pthread_mutex_lock_or_die(&shard->lock);
+    cache_entry_t *entry = cache_find(shard, hash, path);
+    if (entry == NULL) {
+	pthread_mutex_unlock_or_die(&shard->lock);
+	return NULL;
+    }
+    entry->refs++;
+    cache_lru_unlink(shard, entry);
+    cache_lru_push(shard, entry);
+    // one user stats the file while the rest go on serving the entry
+    long now = cache_now_ms();
+    int stale = now - entry->checked >= revalidate_after;
+    if (stale)
+	entry->checked = now;
+    pthread_mutex_unlock_or_die(&shard->lock);
+    
+    if (stale && !cache_current(entry)) {
+	pthread_mutex_lock_or_die(&shard->lock);
+	if (entry->linked)
+	    cache_unlink(shard, entry);
+	pthread_mutex_unlock_or_die(&shard->lock);
+	cache_release(entry);
+	return NULL;
+    }
+    return entry;
+}
+
+//
+// Returns whether a file of size bytes could be cached at all, so that
+// files the cache would turn away are not opened for it.
+//
+int cache_fits(off_t size) {
+    size_t cost = sizeof(cache_entry_t) + (size <= CACHE_MAX_INLINE ? size : 0);
+    return shard_budget > 0 && cost <= shard_budget;
+}
+
+//
+// Drops the least recently used entry of the shard that pins an fd, which
+// is closed once the entry's last user releases it. Returns whether the
+// shard had one.
+//
+static int cache_evict_pinned(cache_shard_t *shard) {
+    pthread_mutex_lock_or_die(&shard->lock);
+    cache_entry_t *entry = shard->lru_tail;
+    while (entry != NULL && entry->fd < 0)
+	entry = entry->lru_prev;
+    int last = entry != NULL && cache_unlink(shard, entry);
+    pthread_mutex_unlock_or_die(&shard->lock);
+    if (last)
+	cache_free(entry);
+    return entry != NULL;
+}
+
+//
+// Counts one more pinned fd for a new entry with this hash, evicting pinned
+// entries (from its own shard first) while there are too many. Returns 0
+// if no more can be evicted, when the file should not be cached.
+//
+static int cache_pin(unsigned long hash) {
+    int tried = 0;
+    while (atomic_fetch_add(&pinned, 1) >= pinned_limit) {
+	atomic_fetch_sub(&pinned, 1);
+	while (!cache_evict_pinned(cache_shard(hash + tried)))
+	    if (++tried == CACHE_SHARDS)
+		return 0;
+    }
+    return 1;
+}
+
+// reads the whole file, returning NULL if it can not
+static char *cache_read(int fd, off_t size) {
+    char *data = malloc(size > 0 ? size : 1);
+    if (data == NULL)
+	return NULL;
+    for (off_t got = 0; got < size;) {
+	ssize_t rc = pread(fd, data + got, size - got, got);
+	if (rc < 0 && errno == EINTR)
+	    continue;
+	if (rc <= 0) {
+	    free(data);
+	    return NULL;
+	}
+	got += rc;
+    }
+    return data;
+}
+
+//
+// Caches the regular file open on fd (with sbuf from fstat), whose response
+// header has been formatted already, evicting the least recently used
+// entries of its shard to make room. Returns the new entry, to be released
+// with cache_release, or NULL if it does not fit (or would pin an fd when
+// none can be freed). Either way the cache takes the fd.
+//
+cache_entry_t *cache_put(char *path, int fd, struct stat *sbuf, char *header) {
+    size_t header_length = strlen(header);
+    int inline_data = sbuf->st_size <= CACHE_MAX_INLINE;
+    size_t cost = sizeof(cache_entry_t) + strlen(path) + header_length +
+	(inline_data ? sbuf->st_size : 0);
+    cache_entry_t *entry;
+    if (cost > shard_budget || (entry = calloc(1, sizeof(cache_entry_t))) == NULL) {
+	close_or_die(fd);
+	return NULL;
+    }
+    entry->path = strdup(path);
+    entry->header = strdup(header);
+    entry->hash = cache_hash(path);
+    entry->fd = -1;
+    if (inline_data) {
+	entry->data = cache_read(fd, sbuf->st_size);
+	close_or_die(fd);
+    } else if (cache_pin(entry->hash)) {
+	entry->fd = fd;
+    } else {
+	close_or_die(fd);
+    }
+    if (entry->path == NULL || entry->header == NULL ||
+	(inline_data ? entry->data == NULL : entry->fd < 0)) {
+	cache_free(entry);
+	return NULL;
+    }
+    entry->dev = sbuf->st_dev;
+    entry->ino = sbuf->st_ino;
+    entry->mtime = sbuf->st_mtim;
+    entry->ctime = sbuf->st_ctim;
+    entry->size = sbuf->st_size;
+    entry->checked = cache_now_ms();
+    entry->header_length = header_length;
+    entry->cost = cost;
+    entry->refs = 2; // the cache's and the caller's
+    entry->linked = 1;
+    
+    cache_shard_t *shard = cache_shard(entry->hash);
+    cache_entry_t *evicted = NULL;
+    pthread_mutex_lock_or_die(&shard->lock);
+    // another worker may have cached the file meanwhile
+    cache_entry_t *old = cache_find(shard, entry->hash, path);
+    if (old != NULL && cache_unlink(shard, old)) {
+	old->next = evicted;
+	evicted = old;
+    }
+    while (shard->bytes + cost > shard_budget || shard->entries == CACHE_SHARD_ENTRIES) {
+	old = shard->lru_tail;
+	if (cache_unlink(shard, old)) {
+	    old->next = evicted;
+	    evicted = old;
+	}
+    }
+    cache_entry_t **bucket = &shard->buckets[entry->hash / CACHE_SHARDS % CACHE_BUCKETS];
+    entry->next = *bucket;
+    *bucket = entry;
+    cache_lru_push(shard, entry);
+    shard->bytes += cost;
+    shard->entries++;
+    pthread_mutex_unlock_or_die(&shard->lock);
+    
+    // free outside the lock
+    while (evicted != NULL) {
+	old = evicted->next;
+	cache_free(evicted);
+	evicted = old;
+    }
+    return entry;
+}
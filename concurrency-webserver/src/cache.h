@@ -0,0 +1,38 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include "io_helper.h"
+
+//
+// A cache of static files, keyed by path. An entry holds the response
+// header (up to, but not including, the blank line that ends it) and either
+// the file's bytes or, for larger files, an open fd to send them from.
+//
+typedef struct cache_entry {
+    char *path;
+    unsigned long hash;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;        // to the ns, with ctime to catch any change
+    struct timespec ctime;
+    off_t size;
+    long checked;                 // when the file was last stat'ed, in ms
+    char *header;
+    size_t header_length;
+    char *data;                   // the file, or NULL if fd is pinned
+    int fd;                       // -1 if data holds the file
+    size_t cost;                  // bytes charged to the memory budget
+    int refs;                     // one for the cache while linked, one per user
+    int linked;
+    struct cache_entry *next;     // in the hash bucket
+    struct cache_entry *lru_prev; // toward more recently used
+    struct cache_entry *lru_next;
+} cache_entry_t;
+
+void cache_init(size_t budget, int revalidate_ms);
+cache_entry_t *cache_get(char *path);
+int cache_fits(off_t size);
+cache_entry_t *cache_put(char *path, int fd, struct stat *sbuf, char *header);
+void cache_release(cache_entry_t *entry);
+
+#endif // __CACHE_H__
@@ -0,0 +1,180 @@
+#define _GNU_SOURCE // for accept4
+
+#include "io_helper.h"
+#include "request.h"
+#include "event_loop.h"
+
+//
+// An epoll event loop per core, each with its own listening socket on the
+// same port (SO_REUSEPORT lets the kernel spread connections between them).
+// Sockets are non-blocking and edge-triggered, and a connection only holds
+// a read buffer while a request is arriving and a response while it is
+// being sent, so idle (and kept alive) connections cost little more than
+// their fd. A response the socket does not take at once is finished when
+// EPOLLOUT says there is room; no more requests are read until then.
+//
+// CGI programs write straight to the socket and have to be waited for, so
+// a connection that asks for one leaves the loop: a thread of its own runs
+// the program with the socket blocking, then closes it.
+//
+
+#define MAXEVENTS (256)
+
+typedef struct {
+    int fd;
+    http_conn_t *http;     // NULL while no bytes of a request are waiting
+    response_t *response;  // NULL while no response is being sent
+} conn_t;
+
+void conn_free(conn_t *conn) {
+    if (conn->response != NULL) {
+	response_free(conn->response);
+	free(conn->response);
+    }
+    free(conn->http);
+    free(conn);
+}
+
+void conn_close(int epoll_fd, conn_t *conn) {
+    // a CGI child may still hold the socket open, which would keep it in
+    // the epoll set after close
+    epoll_ctl_or_die(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close_or_die(conn->fd);
+    conn_free(conn);
+}
+
+void *conn_cgi(void *arg) {
+    conn_t *conn = arg;
+    int flags = fcntl_or_die(conn->fd, F_GETFL, 0);
+    fcntl_or_die(conn->fd, F_SETFL, flags & ~O_NONBLOCK);
+    request_serve_dynamic(conn->fd, conn->response->filename, conn->response->cgiargs);
+    close_or_die(conn->fd);
+    conn_free(conn);
+    return NULL;
+}
+
+//
+// Sends what the socket takes of the pending response, and reads and
+// answers the requests that have arrived, until the socket would block
+// either way.
+//
+void conn_ready(int epoll_fd, conn_t *conn) {
+    while (1) {
+	if (conn->response != NULL) {
+	    int rc = response_send(conn->fd, conn->response);
+	    if (rc == RESPONSE_AGAIN)
+		return; // wait for EPOLLOUT
+	    int keep_alive = rc == RESPONSE_DONE && conn->response->keep_alive;
+	    response_free(conn->response);
+	    free(conn->response);
+	    conn->response = NULL;
+	    if (!keep_alive) {
+		conn_close(epoll_fd, conn);
+		return;
+	    }
+	    http_next(conn->http);
+	}
+	
+	if (conn->http == NULL) {
+	    conn->http = malloc(sizeof(http_conn_t));
+	    assert(conn->http != NULL);
+	    http_conn_init(conn->http, conn->fd);
+	}
+	int rc = http_parse(conn->http);
+	if (rc != HTTP_AGAIN) {
+	    conn->response = malloc(sizeof(response_t));
+	    assert(conn->response != NULL);
+	    response_init(conn->response);
+	    if (rc == HTTP_ERROR) {
+		request_error(conn->response, "request", "400", "Bad Request", "server could not parse this request");
+		continue;
+	    }
+	    request_prepare(conn->response, &conn->http->req);
+	    if (conn->response->cgi) {
+		pthread_t thread;
+		epoll_ctl_or_die(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+		pthread_create_or_die(&thread, NULL, conn_cgi, conn);
+		pthread_detach_or_die(thread);
+		return;
+	    }
+	    continue;
+	}
+	ssize_t got = http_fill(conn->http);
+	if (got < 0 && errno == EINTR)
+	    continue;
+	if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	    break; // wait for the next edge
+	if (got <= 0) {
+	    conn_close(epoll_fd, conn);
+	    return;
+	}
+    }
+    
+    // an idle connection gives its buffer back
+    if (!http_buffered(conn->http) && conn->http->skip == 0) {
+	free(conn->http);
+	conn->http = NULL;
+    }
+}
+
+void accept_all(int epoll_fd, int listen_fd) {
+    while (1) {
+	int conn_fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (conn_fd < 0) {
+	    if (errno == EINTR || errno == ECONNABORTED)
+		continue;
+	    // EAGAIN once the backlog is empty; anything else (e.g., out of
+	    // fds) leaves the rest for the next edge
+	    return;
+	}
+	conn_t *conn = calloc(1, sizeof(conn_t));
+	assert(conn != NULL);
+	conn->fd = conn_fd;
+	struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = conn };
+	epoll_ctl_or_die(epoll_fd, EPOLL_CTL_ADD, conn_fd, &ev);
+    }
+}
+
+void *event_loop(void *arg) {
+    int port = *(int *) arg;
+    int listen_fd = open_listen_fd_reuseport_or_die(port);
+    int epoll_fd = epoll_create1_or_die(EPOLL_CLOEXEC);
+    
+    // the listening socket is the only one without a connection
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLET, .data.ptr = NULL };
+    epoll_ctl_or_die(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+    
+    struct epoll_event events[MAXEVENTS];
+    while (1) {
+	int n = epoll_wait(epoll_fd, events, MAXEVENTS, -1);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	assert(n >= 0);
+	for (int i = 0; i < n; i++) {
+	    conn_t *conn = events[i].data.ptr;
+	    uint32_t ready = events[i].events;
+	    if (conn == NULL)
+		accept_all(epoll_fd, listen_fd);
+	    else if ((ready & EPOLLIN) || ((ready & EPOLLOUT) && conn->response != NULL))
+		conn_ready(epoll_fd, conn);
+	    else if (ready & (EPOLLERR | EPOLLHUP | EPOLLRDHUP))
+		conn_close(epoll_fd, conn);
+	    // else room to write with nothing to send
+	}
+    }
+    return NULL;
+}
+
+//
+// Runs loops event loops, the last one on the calling thread; never returns.
+//
+void event_loop_run(int port, int loops) {
+    static int loop_port;
+    loop_port = port;
+    for (int i = 1; i < loops; i++) {
+	pthread_t thread;
+	pthread_create_or_die(&thread, NULL, event_loop, &loop_port);
+	pthread_detach_or_die(thread);
+    }
+    event_loop(&loop_port);
+}
@@ -0,0 +1,6 @@
+#ifndef __EVENT_LOOP_H__
+#define __EVENT_LOOP_H__
+
+void event_loop_run(int port, int loops);
+
+#endif // __EVENT_LOOP_H__
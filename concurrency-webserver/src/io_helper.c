@@ -22,6 +22,178 @@ ssize_t readline(int fd, void *buf, size_t maxlen) {
     return n;
 }
 
+//
+// Sends all of buf, carrying on after short sends. MSG_NOSIGNAL is added
+// to flags, so a peer that has gone away gives an error, not a SIGPIPE.
+// Returns len, or -1 if the connection fails.
+//
+ssize_t send_all(int fd, const void *buf, size_t len, int flags) {
+    size_t sent = 0;
+    while (sent < len) {
+	ssize_t rc = send(fd, (const char *) buf + sent, len - sent, flags | MSG_NOSIGNAL);
+	if (rc < 0 && errno == EINTR)
+	    continue;
+	if (rc < 0)
+	    return -1;
+	sent += rc;
+    }
+    return len;
+}
+
+enum { HTTP_REQUEST_LINE, HTTP_HEADERS, HTTP_COMPLETE };
+
+void http_conn_init(http_conn_t *conn, int fd) {
+    conn->fd = fd;
+    conn->state = HTTP_REQUEST_LINE;
+    conn->start = 0;
+    conn->scan = 0;
+    conn->length = 0;
+    conn->skip = 0;
+}
+
+// trims spaces (and the CR of a CRLF) off both ends of s, in place
+static char *http_trim(char *s) {
+    while (*s == ' ' || *s == '\t')
+	s++;
+    char *end = s + strlen(s);
+    while (end > s && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r'))
+	end--;
+    *end = '\0';
+    return s;
+}
+
+static int http_parse_request_line(http_request_t *req, char *line) {
+    char *save;
+    req->method = strtok_r(line, " \t\r", &save);
+    req->uri = strtok_r(NULL, " \t\r", &save);
+    req->version = strtok_r(NULL, " \t\r", &save);
+    if (req->version == NULL)
+	return HTTP_ERROR;
+    req->content_length = -1;
+    req->keep_alive = 0;
+    req->range = NULL;
+    req->if_modified_since = NULL;
+    return HTTP_AGAIN;
+}
+
+static int http_parse_header(http_request_t *req, char *line) {
+    char *colon = strchr(line, ':');
+    if (colon == NULL)
+	return HTTP_ERROR;
+    *colon = '\0';
+    char *name = http_trim(line), *value = http_trim(colon + 1);
+    if (strcasecmp(name, "Content-Length") == 0) {
+	char *end;
+	req->content_length = strtol(value, &end, 10);
+	if (end == value || *end != '\0' || req->content_length < 0)
+	    return HTTP_ERROR;
+    } else if (strcasecmp(name, "Connection") == 0) {
+	req->keep_alive = strcasecmp(value, "keep-alive") == 0;
+    } else if (strcasecmp(name, "Range") == 0) {
+	req->range = value;
+    } else if (strcasecmp(name, "If-Modified-Since") == 0) {
+	req->if_modified_since = value;
+    }
+    return HTTP_AGAIN;
+}
+
+//
+// Parses as much of the next request as has been read, a whole line at a
+// time, without reading. Returns HTTP_DONE once the empty line after the
+// headers is found, HTTP_AGAIN if more bytes are needed, or HTTP_ERROR if
+// the request is malformed or does not fit in the buffer.
+//
+int http_parse(http_conn_t *conn) {
+    if (conn->skip > 0) {
+	int part = conn->length - conn->start < conn->skip ? conn->length - conn->start : conn->skip;
+	conn->start += part;
+	conn->scan = conn->start;
+	conn->skip -= part;
+    }
+    char *end;
+    while (conn->state != HTTP_COMPLETE &&
+	   (end = memchr(conn->buf + conn->scan, '\n', conn->length - conn->scan)) != NULL) {
+	char *line = conn->buf + conn->scan;
+	*end = '\0';
+	conn->scan = end + 1 - conn->buf;
+	int rc;
+	if (conn->state == HTTP_REQUEST_LINE) {
+	    // tolerate blank lines between pipelined requests
+	    if (line[0] == '\0' || strcmp(line, "\r") == 0) {
+		conn->start = conn->scan;
+		continue;
+	    }
+	    rc = http_parse_request_line(&conn->req, line);
+	    conn->state = HTTP_HEADERS;
+	} else if (line[0] == '\0' || strcmp(line, "\r") == 0) {
+	    conn->state = HTTP_COMPLETE;
+	    rc = HTTP_DONE;
+	} else {
+	    rc = http_parse_header(&conn->req, line);
+	}
+	if (rc != HTTP_AGAIN)
+	    return rc;
+    }
+    if (conn->state == HTTP_COMPLETE)
+	return HTTP_DONE;
+    // once a request line is parsed its strings point into the buffer, so
+    // it can no longer be moved up to make room
+    if (conn->length == HTTP_MAXREQUEST && (conn->start == 0 || conn->state != HTTP_REQUEST_LINE))
+	return HTTP_ERROR;
+    return HTTP_AGAIN;
+}
+
+//
+// Reads once into the free end of the buffer, first moving the unparsed
+// bytes to the front if there is no room after them. Returns what read()
+// does.
+//
+ssize_t http_fill(http_conn_t *conn) {
+    if (conn->length == HTTP_MAXREQUEST && conn->start > 0) {
+	memmove(conn->buf, conn->buf + conn->start, conn->length - conn->start);
+	conn->scan -= conn->start;
+	conn->length -= conn->start;
+	conn->start = 0;
+    }
+    ssize_t rc = read(conn->fd, conn->buf + conn->length, HTTP_MAXREQUEST - conn->length);
+    if (rc > 0)
+	conn->length += rc;
+    return rc;
+}
+
+//
+// Reads until a whole request has been parsed. Returns HTTP_DONE, HTTP_AGAIN
+// if the connection closes (or fails) first, or HTTP_ERROR.
+//
+int http_read_request(http_conn_t *conn) {
+    int rc;
+    while ((rc = http_parse(conn)) == HTTP_AGAIN) {
+	ssize_t got = http_fill(conn);
+	if (got < 0 && errno == EINTR)
+	    continue;
+	if (got <= 0)
+	    return HTTP_AGAIN;
+    }
+    return rc;
+}
+
+//
+// Drops the request just parsed (and any body it came with), keeping the
+// bytes of pipelined requests after it.
+//
+void http_next(http_conn_t *conn) {
+    conn->start = conn->scan;
+    conn->skip = conn->req.content_length > 0 ? conn->req.content_length : 0;
+    conn->state = HTTP_REQUEST_LINE;
+    memmove(conn->buf, conn->buf + conn->start, conn->length - conn->start);
+    conn->length -= conn->start;
+    conn->start = conn->scan = 0;
+}
+
+// returns whether bytes of another request have been read already
+int http_buffered(http_conn_t *conn) {
+    return conn->length > conn->start;
+}
 
 int open_client_fd(char *hostname, int port) {
     int client_fd;
@@ -46,10 +218,10 @@ int open_client_fd(char *hostname, int port) {
     return client_fd;
 }
 
-int open_listen_fd(int port) {
+static int open_listen_fd_with(int port, int reuseport) {
     // Create a socket descriptor 
     int listen_fd;
-    if ((listen_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+    if ((listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC | (reuseport ? SOCK_NONBLOCK : 0), 0)) < 0) {
 	fprintf(stderr, "socket() failed\n");
 	return -1;
     }
@@ -61,6 +233,14 @@ int open_listen_fd(int port) {
 	return -1;
     }
     
+    // Lets several sockets listen on the port, the kernel spreading new
+    // connections between them
+    if (reuseport &&
+	setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, (const void *) &optval, sizeof(int)) < 0) {
+	fprintf(stderr, "setsockopt() failed\n");
+	return -1;
+    }
+    
     // Listen_fd will be an endpoint for all requests to port on any IP address for this host
     struct sockaddr_in server_addr;
     bzero((char *) &server_addr, sizeof(server_addr));
@@ -80,4 +260,13 @@ int open_listen_fd(int port) {
     return listen_fd;
 }
 
+int open_listen_fd(int port) {
+    return open_listen_fd_with(port, 0);
+}
+
+// a non-blocking listening socket that shares the port with others
+int open_listen_fd_reuseport(int port) {
+    return open_listen_fd_with(port, 1);
+}
+
 
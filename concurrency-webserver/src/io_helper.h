@@ -8,18 +8,23 @@
 #include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <pthread.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/epoll.h>
 #include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/time.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 typedef struct sockaddr sockaddr_t;
@@ -34,6 +39,8 @@ typedef struct sockaddr sockaddr_t;
     assert(execve(filename, argv, envp) == 0); 
 #define wait_or_die(status) \
     ({ pid_t pid = wait(status); assert(pid >= 0); pid; })
+#define waitpid_or_die(pid, status, options) \
+    ({ pid_t rc = waitpid(pid, status, options); assert(rc >= 0); rc; })
 #define gethostname_or_die(name, len) \
     ({ int rc = gethostname(name, len); assert(rc == 0); rc; })
 #define setenv_or_die(name, value, overwrite) \
@@ -50,6 +57,8 @@ typedef struct sockaddr sockaddr_t;
     ({ off_t rc = lseek(fd, offset, whence); assert(rc >= 0); rc; })
 #define close_or_die(fd) \
     assert(close(fd) == 0); 
+#define fcntl_or_die(fd, cmd, arg) \
+    ({ int rc = fcntl(fd, cmd, arg); assert(rc >= 0); rc; })
 #define select_or_die(n, readfds, writefds, exceptfds, timeout) \
     ({ int rc = select(n, readfds, writefds, exceptfds, timeout); assert(rc >= 0); rc; })
 #define dup2_or_die(fd1, fd2) \
@@ -72,17 +81,78 @@ typedef struct sockaddr sockaddr_t;
     { assert(listen(s,  backlog) >= 0); }
 #define accept_or_die(s, addr, addrlen) \
     ({ int rc = accept(s, addr, addrlen); assert(rc >= 0); rc; })
+#define accept4_or_die(s, addr, addrlen, flags) \
+    ({ int rc = accept4(s, addr, addrlen, flags); assert(rc >= 0); rc; })
 #define connect_or_die(sockfd, serv_addr, addrlen) \
     { assert(connect(sockfd, serv_addr, addrlen) >= 0); }
+#define epoll_create1_or_die(flags) \
+    ({ int rc = epoll_create1(flags); assert(rc >= 0); rc; })
+#define epoll_ctl_or_die(epfd, op, fd, event) \
+    { assert(epoll_ctl(epfd, op, fd, event) == 0); }
 #define gethostbyname_or_die(name) \
     ({ struct hostent *p = gethostbyname(name); assert(p != NULL); p; })
 #define gethostbyaddr_or_die(addr, len, type) \
     ({ struct hostent *p = gethostbyaddr(addr, len, type); assert(p != NULL); p; })
+#define pthread_create_or_die(thread, attr, start, arg) \
+    { assert(pthread_create(thread, attr, start, arg) == 0); }
+#define pthread_detach_or_die(thread) \
+    { assert(pthread_detach(thread) == 0); }
+#define pthread_mutex_init_or_die(mutex) \
+    { assert(pthread_mutex_init(mutex, NULL) == 0); }
+#define pthread_mutex_lock_or_die(mutex) \
+    { assert(pthread_mutex_lock(mutex) == 0); }
+#define pthread_mutex_unlock_or_die(mutex) \
+    { assert(pthread_mutex_unlock(mutex) == 0); }
+#define pthread_cond_init_or_die(cond) \
+    { assert(pthread_cond_init(cond, NULL) == 0); }
+#define pthread_cond_wait_or_die(cond, mutex) \
+    { assert(pthread_cond_wait(cond, mutex) == 0); }
+#define pthread_cond_signal_or_die(cond) \
+    { assert(pthread_cond_signal(cond) == 0); }
 
 // client/server helper functions 
 ssize_t readline(int fd, void *buf, size_t maxlen);
+ssize_t send_all(int fd, const void *buf, size_t len, int flags);
 int open_client_fd(char *hostname, int portno);
 int open_listen_fd(int portno);
+int open_listen_fd_reuseport(int portno);
+
+//
+// Incremental HTTP request parsing over a per-connection read buffer. The
+// request line and headers are parsed in place: the strings in an
+// http_request_t point into the buffer and stay valid until http_next().
+//
+#define HTTP_MAXREQUEST (8192)
+
+enum { HTTP_ERROR = -1, HTTP_AGAIN = 0, HTTP_DONE = 1 };
+
+typedef struct {
+    char *method;
+    char *uri;
+    char *version;
+    long content_length;     // -1 if not given
+    int keep_alive;          // set if the client asked for Connection: keep-alive
+    char *range;             // NULL if not given
+    char *if_modified_since; // NULL if not given
+} http_request_t;
+
+typedef struct {
+    int fd;
+    int state;
+    int start;  // where the request being parsed starts
+    int scan;   // where the next line starts
+    int length; // end of the bytes read
+    long skip;  // body bytes of the last request still to discard
+    http_request_t req;
+    char buf[HTTP_MAXREQUEST];
+} http_conn_t;
+
+void http_conn_init(http_conn_t *conn, int fd);
+int http_parse(http_conn_t *conn);
+ssize_t http_fill(http_conn_t *conn);
+int http_read_request(http_conn_t *conn);
+void http_next(http_conn_t *conn);
+int http_buffered(http_conn_t *conn);
 
 // wrappers for above
 #define readline_or_die(fd, buf, maxlen) \
@@ -91,5 +161,7 @@ int open_listen_fd(int portno);
     ({ int rc = open_client_fd(hostname, port); assert(rc >= 0); rc; })
 #define open_listen_fd_or_die(port) \
     ({ int rc = open_listen_fd(port); assert(rc >= 0); rc; })
+#define open_listen_fd_reuseport_or_die(port) \
+    ({ int rc = open_listen_fd_reuseport(port); assert(rc >= 0); rc; })
 
 #endif // __IO_HELPER__
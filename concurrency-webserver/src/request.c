@@ -1,5 +1,8 @@
+#define _GNU_SOURCE // for strptime and timegm
+
 #include "io_helper.h"
 #include "request.h"
+#include "cache.h"
 
 //
 // Some of this code stolen from Bryant/O'Halloran
@@ -8,46 +11,53 @@
 
 #define MAXBUF (8192)
 
-void request_error(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg) {
-    char buf[MAXBUF], body[MAXBUF];
+void response_init(response_t *r) {
+    r->head_length = 0;
+    r->head_sent = 0;
+    r->body = NULL;
+    r->body_fd = -1;
+    r->own_fd = 0;
+    r->offset = 0;
+    r->remaining = 0;
+    r->mapped = NULL;
+    r->mapped_length = 0;
+    r->entry = NULL;
+    r->keep_alive = 0;
+    r->cgi = 0;
+}
+
+void response_free(response_t *r) {
+    if (r->own_fd)
+	close_or_die(r->body_fd);
+    if (r->mapped != NULL)
+	munmap_or_die(r->mapped, r->mapped_length);
+    if (r->entry != NULL)
+	cache_release(r->entry);
+    response_init(r);
+}
+
+void request_error(response_t *r, char *cause, char *errnum, char *shortmsg, char *longmsg) {
+    char body[MAXBUF];
     
     // Create the body of error message first (have to know its length for header)
-    sprintf(body, ""
+    snprintf(body, sizeof(body), ""
 	    "<!doctype html>\r\n"
 	    "<head>\r\n"
 	    "  <title>OSTEP WebServer Error</title>\r\n"
 	    "</head>\r\n"
 	    "<body>\r\n"
 	    "  <h2>%s: %s</h2>\r\n" 
-	    "  <p>%s: %s</p>\r\n"
+	    "  <p>%s: %.1024s</p>\r\n"
 	    "</body>\r\n"
 	    "</html>\r\n", errnum, shortmsg, longmsg, cause);
     
-    // Write out the header information for this response
-    sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    write_or_die(fd, buf, strlen(buf));
-    
-    sprintf(buf, "Content-Type: text/html\r\n");
-    write_or_die(fd, buf, strlen(buf));
-    
-    sprintf(buf, "Content-Length: %lu\r\n\r\n", strlen(body));
-    write_or_die(fd, buf, strlen(buf));
-    
-    // Write out the body last
-    write_or_die(fd, body, strlen(body));
-}
-
-//
-// Reads and discards everything up to an empty text line
-//
-void request_read_headers(int fd) {
-    char buf[MAXBUF];
-    
-    readline_or_die(fd, buf, MAXBUF);
-    while (strcmp(buf, "\r\n")) {
-	readline_or_die(fd, buf, MAXBUF);
-    }
-    return;
+    // The header and body go out together, and the connection is closed
+    r->head_length = snprintf(r->head, sizeof(r->head), ""
+	    "HTTP/1.0 %s %s\r\n"
+	    "Content-Type: text/html\r\n"
+	    "Content-Length: %lu\r\n\r\n"
+	    "%s", errnum, shortmsg, strlen(body), body);
+    r->keep_alive = 0;
 }
 
 //
@@ -102,79 +112,361 @@ void request_serve_dynamic(int fd, char *filename, char *cgiargs) {
 	    "HTTP/1.0 200 OK\r\n"
 	    "Server: OSTEP WebServer\r\n");
     
-    write_or_die(fd, buf, strlen(buf));
+    if (send_all(fd, buf, strlen(buf), 0) < 0)
+	return;
     
-    if (fork_or_die() == 0) {                        // child
+    pid_t pid = fork_or_die();
+    if (pid == 0) {                                  // child
+	signal(SIGPIPE, SIG_DFL);                    // the server ignores it
 	setenv_or_die("QUERY_STRING", cgiargs, 1);   // args to cgi go here
 	dup2_or_die(fd, STDOUT_FILENO);              // make cgi writes go to socket (not screen)
 	extern char **environ;                       // defined by libc 
 	execve_or_die(filename, argv, environ);
     } else {
-	wait_or_die(NULL);
+	// other workers have children of their own, so wait for this one
+	waitpid_or_die(pid, NULL, 0);
+    }
+}
+
+//
+// Maps the rest of the file, for when sendfile() can not send it. Returns
+// whether it could.
+//
+int response_map(response_t *r) {
+    // the mapping has to start on a page boundary
+    off_t start = r->offset & ~(off_t) (sysconf(_SC_PAGESIZE) - 1);
+    size_t length = r->offset - start + r->remaining;
+    void *mapped = mmap(0, length, PROT_READ, MAP_PRIVATE, r->body_fd, start);
+    if (mapped == MAP_FAILED)
+	return 0;
+    r->mapped = mapped;
+    r->mapped_length = length;
+    r->body = (char *) mapped + (r->offset - start);
+    r->offset = 0;
+    return 1;
+}
+
+//
+// Sends as much of the response as the socket takes, carrying on from
+// where the last call stopped. A body in memory goes out with the head in
+// one sendmsg(); a file is copied in the kernel by sendfile(), after the
+// head is sent with MSG_MORE so the two share a segment. Returns
+// RESPONSE_DONE once it is all sent, RESPONSE_AGAIN if a non-blocking
+// socket is full, or RESPONSE_ERROR if the client went away (or the file
+// shrank).
+//
+int response_send(int fd, response_t *r) {
+    while (r->head_sent < r->head_length || r->remaining > 0) {
+	size_t head_left = r->head_length - r->head_sent;
+	ssize_t rc;
+	if (r->body != NULL || r->remaining == 0) {
+	    struct iovec iov[2] = {
+		{ r->head + r->head_sent, head_left },
+		{ r->body != NULL ? r->body + r->offset : NULL, r->remaining },
+	    };
+	    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = r->remaining > 0 ? 2 : 1 };
+	    rc = sendmsg(fd, &msg, MSG_NOSIGNAL);
+	    if (rc > 0) {
+		size_t head_part = (size_t) rc < head_left ? (size_t) rc : head_left;
+		r->head_sent += head_part;
+		r->offset += rc - head_part;
+		r->remaining -= rc - head_part;
+	    }
+	} else if (head_left > 0) {
+	    rc = send(fd, r->head + r->head_sent, head_left, MSG_NOSIGNAL | MSG_MORE);
+	    if (rc > 0)
+		r->head_sent += rc;
+	} else {
+	    rc = sendfile(fd, r->body_fd, &r->offset, r->remaining);
+	    if (rc < 0 && (errno == EINVAL || errno == ENOSYS) && response_map(r))
+		continue;
+	    if (rc == 0)
+		return RESPONSE_ERROR; // the file shrank
+	    if (rc > 0)
+		r->remaining -= rc;
+	}
+	if (rc < 0 && errno == EINTR)
+	    continue;
+	if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	    return RESPONSE_AGAIN;
+	if (rc < 0)
+	    return RESPONSE_ERROR;
     }
+    return RESPONSE_DONE;
+}
+
+//
+// Parses a Range header for a single range of bytes, the only kind served.
+// Returns 1 and sets [first, last] if it is one, 0 if the whole file should
+// be sent instead, or -1 if the range starts past the end of the file.
+//
+int request_parse_range(char *range, off_t filesize, off_t *first, off_t *last) {
+    char *dash, *end;
+    if (range == NULL || strncasecmp(range, "bytes=", 6) || strchr(range, ','))
+	return 0;
+    range += 6;
+    if ((dash = strchr(range, '-')) == NULL)
+	return 0;
+    if (dash == range) {
+	// a suffix: the last n bytes
+	long long n = strtoll(dash + 1, &end, 10);
+	if (end == dash + 1 || *end != '\0' || n <= 0)
+	    return 0;
+	*first = n < filesize ? filesize - n : 0;
+	*last = filesize - 1;
+	return filesize > 0 ? 1 : -1;
+    }
+    *first = strtoll(range, &end, 10);
+    if (end != dash || *first < 0)
+	return 0;
+    *last = filesize - 1;
+    if (dash[1] != '\0') {
+	long long n = strtoll(dash + 1, &end, 10);
+	if (*end != '\0' || n < *first)
+	    return 0;
+	if (n < *last)
+	    *last = n;
+    }
+    return *first < filesize ? 1 : -1;
+}
+
+// returns whether the file has not changed since the date of an
+// If-Modified-Since header
+int request_not_modified(char *since, time_t mtime) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    if (since == NULL || strptime(since, "%a, %d %b %Y %H:%M:%S GMT", &tm) == NULL)
+	return 0;
+    return mtime <= timegm(&tm);
+}
+
+// formats the Last-Modified date of a file
+void request_format_date(char *buf, size_t size, time_t mtime) {
+    struct tm tm;
+    strftime(buf, size, "%a, %d %b %Y %H:%M:%S GMT", gmtime_r(&mtime, &tm));
 }
 
-void request_serve_static(int fd, char *filename, int filesize) {
-    int srcfd;
-    char *srcp, filetype[MAXBUF], buf[MAXBUF];
+//
+// Formats the header of a response with length bytes of a static file,
+// up to the Connection header and the blank line that end it.
+//
+void request_format_static(char *buf, char *filename, struct stat *sbuf, char *status, off_t length, char *range) {
+    char filetype[MAXBUF], modified[64];
     
     request_get_filetype(filename, filetype);
-    srcfd = open_or_die(filename, O_RDONLY, 0);
-    
-    // Rather than call read() to read the file into memory, 
-    // which would require that we allocate a buffer, we memory-map the file
-    srcp = mmap_or_die(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0);
-    close_or_die(srcfd);
-    
-    // put together response
+    request_format_date(modified, sizeof(modified), sbuf->st_mtime);
     sprintf(buf, ""
-	    "HTTP/1.0 200 OK\r\n"
+	    "HTTP/1.0 %s\r\n"
+	    "Server: OSTEP WebServer\r\n"
+	    "Content-Length: %lld\r\n"
+	    "Content-Type: %s\r\n"
+	    "Last-Modified: %s\r\n"
+	    "%s",
+	    status, (long long) length, filetype, modified, range);
+}
+
+// puts together a 304 response for a file that has not changed
+void request_not_modified_response(response_t *r, time_t mtime, int keep_alive) {
+    char modified[64];
+    
+    request_format_date(modified, sizeof(modified), mtime);
+    r->head_length = sprintf(r->head, ""
+	    "HTTP/1.0 304 Not Modified\r\n"
 	    "Server: OSTEP WebServer\r\n"
-	    "Content-Length: %d\r\n"
-	    "Content-Type: %s\r\n\r\n", 
-	    filesize, filetype);
+	    "Last-Modified: %s\r\n"
+	    "%s",
+	    modified, keep_alive ? "Connection: keep-alive\r\n\r\n" : "\r\n");
+    r->keep_alive = keep_alive;
+}
+
+//
+// Puts together the response with a static file, or the part of it asked
+// for by a Range header. The body is sent from the file, which stays open
+// until the response is freed.
+//
+void request_prepare_static(response_t *r, char *filename, struct stat *sbuf, http_request_t *req) {
+    off_t filesize = sbuf->st_size, first = 0, last = filesize - 1;
+    char *keep_alive = req->keep_alive ? "Connection: keep-alive\r\n" : "";
+    
+    if (request_not_modified(req->if_modified_since, sbuf->st_mtime)) {
+	request_not_modified_response(r, sbuf->st_mtime, req->keep_alive);
+	return;
+    }
+    int partial = request_parse_range(req->range, filesize, &first, &last);
+    if (partial < 0) {
+	r->head_length = sprintf(r->head, ""
+		"HTTP/1.0 416 Range Not Satisfiable\r\n"
+		"Server: OSTEP WebServer\r\n"
+		"Content-Range: bytes */%lld\r\n"
+		"Content-Length: 0\r\n"
+		"%s\r\n",
+		(long long) filesize, keep_alive);
+	r->keep_alive = req->keep_alive;
+	return;
+    }
+    
+    // an empty file has no body to open
+    if (last >= first) {
+	r->body_fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (r->body_fd < 0) {
+	    request_error(r, filename, "403", "Forbidden", "server could not read this file");
+	    return;
+	}
+	r->own_fd = 1;
+	r->offset = first;
+	r->remaining = last + 1 - first;
+    }
     
-    write_or_die(fd, buf, strlen(buf));
+    // put together response
+    char range[128] = "";
+    if (partial)
+	sprintf(range, "Content-Range: bytes %lld-%lld/%lld\r\n",
+		(long long) first, (long long) last, (long long) filesize);
+    request_format_static(r->head, filename, sbuf, partial ? "206 Partial Content" : "200 OK",
+			  last + 1 - first, range);
+    strcat(r->head, keep_alive);
+    strcat(r->head, "\r\n");
+    r->head_length = strlen(r->head);
+    r->keep_alive = req->keep_alive;
+}
+
+//
+// Opens the file and adds it to the cache with the header of a whole file
+// response. Returns its entry, or NULL if it is not a file the server may
+// read or does not fit in the cache.
+//
+cache_entry_t *request_cache_file(char *filename) {
+    char buf[MAXBUF];
+    struct stat sbuf;
     
-    //  Writes out to the client socket the memory-mapped file 
-    write_or_die(fd, srcp, filesize);
-    munmap_or_die(srcp, filesize);
+    int srcfd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (srcfd < 0)
+	return NULL;
+    if (fstat(srcfd, &sbuf) < 0 || !(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) {
+	close_or_die(srcfd);
+	return NULL;
+    }
+    request_format_static(buf, filename, &sbuf, "200 OK", sbuf.st_size, "");
+    return cache_put(filename, srcfd, &sbuf, buf);
 }
 
-// handle a request
-void request_handle(int fd) {
+//
+// Puts together the response with a whole file from its cache entry, which
+// the response holds until it is sent: from memory, or from the pinned fd.
+//
+void request_prepare_cached(response_t *r, cache_entry_t *entry, http_request_t *req) {
+    r->entry = entry;
+    if (request_not_modified(req->if_modified_since, entry->mtime.tv_sec)) {
+	request_not_modified_response(r, entry->mtime.tv_sec, req->keep_alive);
+	return;
+    }
+    r->head_length = sprintf(r->head, "%s%s", entry->header,
+			     req->keep_alive ? "Connection: keep-alive\r\n\r\n" : "\r\n");
+    r->body = entry->data;
+    r->body_fd = entry->fd;
+    r->remaining = entry->size;
+    r->keep_alive = req->keep_alive;
+}
+
+//
+// Puts together the response to a parsed request, without writing to the
+// connection. A CGI program only sets r->cgi, as it writes its own
+// response. Errors and CGI output close the connection; CGI output has no
+// length the server knows.
+//
+void request_prepare(response_t *r, http_request_t *req) {
     int is_static;
     struct stat sbuf;
-    char buf[MAXBUF], method[MAXBUF], uri[MAXBUF], version[MAXBUF];
-    char filename[MAXBUF], cgiargs[MAXBUF];
+    char *method = req->method, *uri = req->uri;
     
-    readline_or_die(fd, buf, MAXBUF);
-    sscanf(buf, "%s %s %s", method, uri, version);
-    printf("method:%s uri:%s version:%s\n", method, uri, version);
+    printf("method:%s uri:%s version:%s\n", method, uri, req->version);
     
     if (strcasecmp(method, "GET")) {
-	request_error(fd, method, "501", "Not Implemented", "server does not implement this method");
+	request_error(r, method, "501", "Not Implemented", "server does not implement this method");
 	return;
     }
-    request_read_headers(fd);
+    if (strlen(uri) >= HTTP_MAXREQUEST - 16) {
+	request_error(r, "uri", "414", "URI Too Long", "server could not handle this uri");
+	return;
+    }
+    
+    is_static = request_parse_uri(uri, r->filename, r->cgiargs);
     
-    is_static = request_parse_uri(uri, filename, cgiargs);
-    if (stat(filename, &sbuf) < 0) {
-	request_error(fd, filename, "404", "Not found", "server could not find this file");
+    // whole static files are served from the cache when they can be
+    if (is_static && req->range == NULL) {
+	cache_entry_t *entry = cache_get(r->filename);
+	if (entry != NULL) {
+	    request_prepare_cached(r, entry, req);
+	    return;
+	}
+    }
+    
+    if (stat(r->filename, &sbuf) < 0) {
+	request_error(r, r->filename, "404", "Not found", "server could not find this file");
 	return;
     }
     
     if (is_static) {
 	if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) {
-	    request_error(fd, filename, "403", "Forbidden", "server could not read this file");
+	    request_error(r, r->filename, "403", "Forbidden", "server could not read this file");
 	    return;
 	}
-	request_serve_static(fd, filename, sbuf.st_size);
+	// and cached the first time they are asked for, if the cache is on
+	// and has room for them
+	if (req->range == NULL && cache_fits(sbuf.st_size)) {
+	    cache_entry_t *entry = request_cache_file(r->filename);
+	    if (entry != NULL) {
+		request_prepare_cached(r, entry, req);
+		return;
+	    }
+	}
+	request_prepare_static(r, r->filename, &sbuf, req);
     } else {
 	if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) {
-	    request_error(fd, filename, "403", "Forbidden", "server could not run this CGI program");
+	    request_error(r, r->filename, "403", "Forbidden", "server could not run this CGI program");
 	    return;
 	}
-	request_serve_dynamic(fd, filename, cgiargs);
+	r->cgi = 1;
+    }
+}
+
+//
+// Serves a parsed request on a blocking socket. Returns whether the
+// connection can be kept open for another request.
+//
+int request_serve(int fd, http_request_t *req) {
+    response_t r;
+    int keep_alive = 0;
+    
+    response_init(&r);
+    request_prepare(&r, req);
+    if (r.cgi)
+	request_serve_dynamic(fd, r.filename, r.cgiargs);
+    else
+	keep_alive = response_send(fd, &r) == RESPONSE_DONE && r.keep_alive;
+    response_free(&r);
+    return keep_alive;
+}
+
+//
+// Handles the requests on a connection, several in a row if the client
+// keeps it alive (and pipelines them).
+//
+void request_handle(int fd) {
+    http_conn_t conn;
+    int rc;
+    
+    http_conn_init(&conn, fd);
+    while ((rc = http_read_request(&conn)) == HTTP_DONE) {
+	if (!request_serve(fd, &conn.req))
+	    return;
+	http_next(&conn);
+    }
+    if (rc == HTTP_ERROR) {
+	response_t r;
+	response_init(&r);
+	request_error(&r, "request", "400", "Bad Request", "server could not parse this request");
+	response_send(fd, &r);
+	response_free(&r);
     }
 }
@@ -1,5 +1,45 @@
 #ifndef __REQUEST_H__
+#define __REQUEST_H__
+
+#include "io_helper.h"
+
+struct cache_entry;
+
+#define RESPONSE_MAXHEAD (2 * HTTP_MAXREQUEST)
+
+enum { RESPONSE_ERROR = -1, RESPONSE_AGAIN = 0, RESPONSE_DONE = 1 };
+
+//
+// A response, put together before any of it is sent so that it can go out
+// a piece at a time on a non-blocking socket. The head holds the status
+// line and headers (and the whole of an error page); the body is then
+// either bytes in memory or bytes of a file.
+//
+typedef struct {
+    char head[RESPONSE_MAXHEAD];
+    size_t head_length;
+    size_t head_sent;
+    char *body;                // the body in memory, or NULL
+    int body_fd;               // the file the body is sent from, or -1
+    int own_fd;                // set if body_fd is closed with the response
+    off_t offset;              // where the rest of the body starts
+    off_t remaining;           // body bytes still to send
+    void *mapped;              // a mapping of the file, if sendfile() failed
+    size_t mapped_length;
+    struct cache_entry *entry; // held while the body is sent from it
+    int keep_alive;
+    int cgi;                   // set if filename has to be run instead
+    char filename[HTTP_MAXREQUEST];
+    char cgiargs[HTTP_MAXREQUEST];
+} response_t;
 
 void request_handle(int fd);
+int request_serve(int fd, http_request_t *req);
+void request_serve_dynamic(int fd, char *filename, char *cgiargs);
+void request_prepare(response_t *r, http_request_t *req);
+void request_error(response_t *r, char *cause, char *errnum, char *shortmsg, char *longmsg);
+void response_init(response_t *r);
+int response_send(int fd, response_t *r);
+void response_free(response_t *r);
 
 #endif // __REQUEST_H__
@@ -1,18 +1,107 @@
+#define _GNU_SOURCE // for accept4
+
+#include <pthread.h>
 #include <stdio.h>
 #include "request.h"
 #include "io_helper.h"
+#include "event_loop.h"
+#include "cache.h"
 
 char default_root[] = ".";
 
+// a pool worker drops a connection that sends it nothing (or takes nothing
+// from it) for this many seconds, so idle keep-alive clients can not hold
+// every worker
+#define CONN_TIMEOUT (5)
+
+//
+// Accepted connections wait here for a worker thread; the master thread
+// blocks when it is full and the workers block when it is empty.
+//
+typedef struct {
+    int *fds;
+    int size;
+    int head;
+    int count;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} conn_buffer_t;
+
+void conn_buffer_init(conn_buffer_t *b, int size) {
+    b->fds = malloc(size * sizeof(int));
+    assert(b->fds != NULL);
+    b->size = size;
+    b->head = 0;
+    b->count = 0;
+    pthread_mutex_init_or_die(&b->lock);
+    pthread_cond_init_or_die(&b->not_empty);
+    pthread_cond_init_or_die(&b->not_full);
+}
+
+void conn_buffer_put(conn_buffer_t *b, int fd) {
+    pthread_mutex_lock_or_die(&b->lock);
+    while (b->count == b->size)
+	pthread_cond_wait_or_die(&b->not_full, &b->lock);
+    b->fds[(b->head + b->count) % b->size] = fd;
+    b->count++;
+    pthread_cond_signal_or_die(&b->not_empty);
+    pthread_mutex_unlock_or_die(&b->lock);
+}
+
+int conn_buffer_get(conn_buffer_t *b) {
+    pthread_mutex_lock_or_die(&b->lock);
+    while (b->count == 0)
+	pthread_cond_wait_or_die(&b->not_empty, &b->lock);
+    int fd = b->fds[b->head];
+    b->head = (b->head + 1) % b->size;
+    b->count--;
+    pthread_cond_signal_or_die(&b->not_full);
+    pthread_mutex_unlock_or_die(&b->lock);
+    return fd;
+}
+
+void *worker(void *arg) {
+    conn_buffer_t *b = arg;
+    while (1) {
+	int conn_fd = conn_buffer_get(b);
+	struct timeval timeout = { .tv_sec = CONN_TIMEOUT };
+	setsockopt_or_die(conn_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt_or_die(conn_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	request_handle(conn_fd);
+	close_or_die(conn_fd);
+    }
+    return NULL;
+}
+
+void usage() {
+    fprintf(stderr, "usage: wserver [-d basedir] [-p port] [-t threads] [-b buffers] [-m pool|epoll] [-c cache_mb] [-r seconds]\n");
+    exit(1);
+}
+
+//
+// ./wserver [-d <basedir>] [-p <portnum>] [-t <threads>] [-b <buffers>] [-m pool|epoll]
+//           [-c <cache_mb>] [-r <seconds>]
 //
-// ./wserver [-d <basedir>] [-p <portnum>] 
+// In pool mode (the default), the main thread accepts connections and hands
+// them to threads worker threads, which close connections that have been
+// idle for CONN_TIMEOUT seconds. In epoll mode, threads event loops (by
+// default, one per core) each accept and read their own connections.
+//
+// Static files are cached in up to cache_mb MiB (0 turns the cache off),
+// and a cached file is checked for changes at most every seconds.
 // 
 int main(int argc, char *argv[]) {
     int c;
     char *root_dir = default_root;
     int port = 10000;
+    int threads = 0;
+    int buffers = 1;
+    int epoll = 0;
+    int cache_mb = 64;
+    int revalidate = 1;
     
-    while ((c = getopt(argc, argv, "d:p:")) != -1)
+    while ((c = getopt(argc, argv, "d:p:t:b:m:c:r:")) != -1)
 	switch (c) {
 	case 'd':
 	    root_dir = optarg;
@@ -20,22 +109,63 @@ int main(int argc, char *argv[]) {
 	case 'p':
 	    port = atoi(optarg);
 	    break;
+	case 't':
+	    threads = atoi(optarg);
+	    break;
+	case 'b':
+	    buffers = atoi(optarg);
+	    break;
+	case 'c':
+	    cache_mb = atoi(optarg);
+	    break;
+	case 'r':
+	    revalidate = atoi(optarg);
+	    break;
+	case 'm':
+	    if (strcmp(optarg, "epoll") == 0) {
+		epoll = 1;
+		break;
+	    } else if (strcmp(optarg, "pool") == 0) {
+		break;
+	    }
+	    // fall through
 	default:
-	    fprintf(stderr, "usage: wserver [-d basedir] [-p port]\n");
-	    exit(1);
+	    usage();
 	}
+    if (threads < 0 || buffers <= 0 || cache_mb < 0 || revalidate < 0)
+	usage();
+
+    // a client that goes away should only cost its own connection
+    signal(SIGPIPE, SIG_IGN);
 
     // run out of this directory
     chdir_or_die(root_dir);
+    cache_init((size_t) cache_mb << 20, revalidate * 1000);
+
+    if (epoll) {
+	if (threads == 0)
+	    threads = sysconf(_SC_NPROCESSORS_ONLN);
+	event_loop_run(port, threads);
+    }
+    if (threads == 0)
+	threads = 1;
+
+    // start the workers before taking any connections
+    conn_buffer_t buffer;
+    conn_buffer_init(&buffer, buffers);
+    for (int i = 0; i < threads; i++) {
+	pthread_t thread;
+	pthread_create_or_die(&thread, NULL, worker, &buffer);
+	pthread_detach_or_die(thread);
+    }
 
     // now, get to work
     int listen_fd = open_listen_fd_or_die(port);
     while (1) {
 	struct sockaddr_in client_addr;
 	int client_len = sizeof(client_addr);
-	int conn_fd = accept_or_die(listen_fd, (sockaddr_t *) &client_addr, (socklen_t *) &client_len);
-	request_handle(conn_fd);
-	close_or_die(conn_fd);
+	int conn_fd = accept4_or_die(listen_fd, (sockaddr_t *) &client_addr, (socklen_t *) &client_len, SOCK_CLOEXEC);
+	conn_buffer_put(&buffer, conn_fd);
     }
     return 0;
 }
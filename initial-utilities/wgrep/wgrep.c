@@ -1,59 +1,730 @@
+#define _GNU_SOURCE // for memrchr
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <sys/_types/_size_t.h>
-#include <sys/_types/_ssize_t.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+const long MIN_THREAD_BYTES = 1 << 24; // Files are only split across threads
+                                       // so each gets at least this much.
+const size_t STREAM_BUFF_SIZE = 1 << 20; // How much of a stream is read at
+                                         // once.
+const int FLUSH_RANGES = 1 << 12; // Ranges found in a stream or a single
+                                  // threaded file are written this often.
+const int FILES_PER_THREAD = 4; // How far ahead of the output files are
+                                // searched, when it is kept in order.
+const uint32_t OUTPUT_FLAG = 1u << 31; // Marks a transition to a state where
+                                       // a pattern ends.
+const char USAGE[] = "wgrep: [-e pattern]... [-f file]... [-j threads] [-u] "
+                     "[searchterm] [file ...]\n";
+
+/*
+ * An Aho-Corasick automaton over many patterns, as a dense table of
+ * transitions. Bytes that no pattern tells apart share a class, so a row only
+ * has a column per class, and rows are stored premultiplied so following a
+ * transition is a single load.
+ */
+typedef struct {
+  unsigned short classes[256]; // The column of each byte. Bytes in no
+                               // pattern share column 0.
+  int nclasses;
+  uint32_t *next; // next[row + class] is the row of the next state, with
+                  // OUTPUT_FLAG set if a pattern ends there.
+  int *out;       // The pattern ending at each state, or -1.
+  int *dict;      // The next state along the fail links with an out, or -1.
+  char **patterns;
+  int npatterns;
+  int *same;  // The first pattern equal to each pattern, which counts for it.
+  int empty;  // An empty pattern, which matches every line, or -1.
+} Automaton;
+
+// What to search for: a single term, or the patterns of an automaton.
+typedef struct {
+  char *term;
+  size_t term_length;
+  Automaton *automaton;
+} Query;
+
+/*
+ * The matching lines found in part of the input, in order. Neighbouring lines
+ * are merged into one range, and they point into the input, so nothing is
+ * copied until it is written.
+ */
+typedef struct {
+  char *begin;
+  size_t length;
+} Range;
+
+/*
+ * Where the lines found in a file go, and the lines each pattern was found
+ * on.
+ */
+typedef struct {
+  FILE *out;
+  long *counts;
+  long split; // The most threads a large file may be searched by, from -j.
+              // A file is searched by one thread if this is 0.
+} Results;
+
+typedef struct {
+  Range *ranges;
+  int length;
+  int capacity;
+  FILE *out;
+  int flush;           // Set if the ranges are written once there are
+                       // FLUSH_RANGES.
+  long *counts;        // The lines each pattern was found on, with patterns.
+  char **counted_line; // The last line each pattern was counted on.
+} Matches;
 
-int match(char *search, char *string);
-int search_file(char *filename, char *search_term);
+typedef struct {
+  char *begin;
+  char *end;
+  Query *query;
+  Matches matches;
+  pthread_t thread;
+} Section;
+
+/*
+ * Files searched by a pool of threads. Each file's lines are kept in memory
+ * until the main thread writes them in argument order, and no thread runs
+ * more than FILES_PER_THREAD files ahead per thread. Unordered, the lines
+ * are written as soon as they are found.
+ */
+typedef struct {
+  char **files;
+  int nfiles;
+  Query *query;
+  int ordered;
+  int nthreads;
+  int next;    // The next file to search.
+  int written; // The files written so far.
+  char **outs; // The lines found in each file, once it has been searched.
+  size_t *out_lengths;
+  int *done;    // Set once a file has been searched.
+  int failed;   // Set if a file could not be opened.
+  pthread_mutex_t guard;
+  pthread_cond_t searched; // Signalled when a file has been searched.
+  pthread_cond_t emptied;  // Signalled when a file has been written.
+} FilePool;
+
+typedef struct {
+  FilePool *pool;
+  Results results;
+  pthread_t thread;
+} FileWorker;
+
+int search_file(char *filename, Query *query, Results *results);
+int search_files(char **files, int nfiles, Query *query, int nthreads,
+                 int ordered, long *counts);
+int add_pattern_file(char *filename, char ***patterns, int *npatterns);
+Automaton *automaton_create(char **patterns, int npatterns);
+void automaton_destroy(Automaton *automaton);
+void print_counts(Automaton *automaton, long *counts);
+
+// returns whether arg is one of the options, -e, -f, -j or -u.
+int is_option(char *arg) {
+  return arg[0] == '-' && arg[1] != '\0' && strchr("efju", arg[1]) != NULL;
+}
 
 int main(int argc, char **argv) {
-  if (argc < 2) {
-    printf("wgrep: searchterm [file ...]\n");
+  char **patterns = NULL;
+  int npatterns = 0, opt, ordered = 1, bad = 0;
+  int use_patterns = 0; // Set by -e or -f, even if -f gives no patterns.
+  long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  // Options end at the first argument that is not one, so a search term
+  // may start with '-'.
+  while (optind < argc && is_option(argv[optind]) &&
+         (opt = getopt(argc, argv, "+e:f:j:u")) != -1) {
+    if (opt == 'e' || opt == 'f')
+      use_patterns = 1;
+    if (opt == 'e') {
+      patterns = (char **)realloc(patterns, sizeof(char *) * (npatterns + 1));
+      if (patterns == NULL)
+        return 1;
+      patterns[npatterns++] = optarg;
+    } else if (opt == 'f') {
+      if (add_pattern_file(optarg, &patterns, &npatterns)) {
+        fprintf(stderr, "wgrep: cannot open pattern file %s\n", optarg);
+        return 1;
+      }
+    } else if (opt == 'j') {
+      bad = (nthreads = atol(optarg)) < 1;
+    } else if (opt == 'u') {
+      ordered = 0;
+    } else {
+      bad = 1;
+    }
+    if (bad) {
+      fputs(USAGE, stdout);
+      return 1;
+    }
+  }
+  Query query = {NULL, 0, NULL};
+  if (use_patterns) {
+    query.automaton = automaton_create(patterns, npatterns);
+  } else if (optind == argc) {
+    fputs(USAGE, stdout);
     return 1;
-  } else if (argc == 2) {
-    search_file(NULL, argv[1]);
   } else {
-    for (int i = 2; i < argc; i++)
-      if (search_file(argv[i], argv[1])) {
-        return 1;
+    query.term = argv[optind++];
+    query.term_length = strlen(query.term);
+  }
+  int out = 0;
+  long *counts = use_patterns ? (long *)calloc(npatterns, sizeof(long)) : NULL;
+  Results results = {stdout, counts, nthreads};
+  if (optind == argc) {
+    out = search_file(NULL, &query, &results);
+  } else if (argc - optind == 1 || nthreads == 1) {
+    // A file that can not be opened does not stop the others.
+    for (int i = optind; i < argc; i++)
+      out |= search_file(argv[i], &query, &results);
+  } else {
+    out = search_files(argv + optind, argc - optind, &query, nthreads, ordered,
+                       counts);
+  }
+  if (use_patterns) {
+    print_counts(query.automaton, counts);
+    automaton_destroy(query.automaton);
+    free(counts);
+  }
+  return out;
+}
+
+/*
+ * Adds every line of a file to patterns, returning 0 if successful.
+ */
+int add_pattern_file(char *filename, char ***patterns, int *npatterns) {
+  FILE *fp = fopen(filename, "r");
+  if (fp == NULL)
+    return 1;
+  char *line = NULL;
+  size_t linecap = 0;
+  ssize_t linelen;
+  while ((linelen = getline(&line, &linecap, fp)) > 0) {
+    if (line[linelen - 1] == '\n')
+      line[linelen - 1] = '\0';
+    *patterns = (char **)realloc(*patterns, sizeof(char *) * (*npatterns + 1));
+    if (*patterns == NULL || ((*patterns)[*npatterns] = strdup(line)) == NULL)
+      exit(1);
+    (*npatterns)++;
+  }
+  free(line);
+  fclose(fp);
+  return 0;
+}
+
+/*
+ * Builds the automaton for patterns, which it keeps. A pattern with a newline
+ * before its end can never be inside a line, so it is left out.
+ */
+Automaton *automaton_create(char **patterns, int npatterns) {
+  Automaton *automaton = (Automaton *)calloc(1, sizeof(Automaton));
+  int *same = (int *)malloc(sizeof(int) * npatterns);
+  if (automaton == NULL || same == NULL)
+    exit(1);
+  automaton->patterns = patterns;
+  automaton->npatterns = npatterns;
+  automaton->same = same;
+  automaton->empty = -1;
+
+  // Give every byte used by a pattern its own column.
+  size_t total = 0;
+  int nclasses = 1;
+  for (int i = 0; i < npatterns; i++) {
+    for (unsigned char *c = (unsigned char *)patterns[i]; *c; c++, total++)
+      if (automaton->classes[*c] == 0)
+        automaton->classes[*c] = nclasses++;
+  }
+  automaton->nclasses = nclasses;
+
+  // The trie, where -1 is a missing edge.
+  int *trie = (int *)malloc(sizeof(int) * (total + 1) * nclasses);
+  int *out = (int *)malloc(sizeof(int) * (total + 1));
+  int *dict = (int *)malloc(sizeof(int) * (total + 1));
+  int *fail = (int *)malloc(sizeof(int) * (total + 1));
+  if (trie == NULL || out == NULL || dict == NULL || fail == NULL)
+    exit(1);
+  int nstates = 1;
+  for (int c = 0; c < nclasses; c++)
+    trie[c] = -1;
+  out[0] = dict[0] = -1;
+  for (int i = 0; i < npatterns; i++) {
+    size_t length = strlen(patterns[i]);
+    same[i] = i;
+    if (length > 1 && memchr(patterns[i], '\n', length - 1))
+      continue;
+    int state = 0;
+    for (size_t j = 0; j < length; j++) {
+      int *edge = trie + state * nclasses +
+                  automaton->classes[(unsigned char)patterns[i][j]];
+      if (*edge == -1) {
+        *edge = nstates;
+        for (int c = 0; c < nclasses; c++)
+          trie[nstates * nclasses + c] = -1;
+        out[nstates] = dict[nstates] = -1;
+        nstates++;
       }
+      state = *edge;
+    }
+    if (out[state] >= 0)
+      same[i] = out[state];
+    else
+      out[state] = i;
+  }
+  if (out[0] >= 0) {
+    automaton->empty = out[0];
+    out[0] = -1;
+  }
+
+  // Turn the trie into a table of transitions, breadth first, so the fail
+  // state of every state is done before it.
+  int *queue = (int *)malloc(sizeof(int) * nstates);
+  if (queue == NULL)
+    exit(1);
+  int head = 0, tail = 0;
+  fail[0] = 0;
+  queue[tail++] = 0;
+  while (head < tail) {
+    int state = queue[head++];
+    int *row = trie + state * nclasses;
+    for (int c = 0; c < nclasses; c++) {
+      int child = row[c];
+      int fallback = state ? trie[fail[state] * nclasses + c] : 0;
+      if (child == -1) {
+        row[c] = fallback;
+        continue;
+      }
+      fail[child] = fallback;
+      dict[child] = out[fallback] >= 0 ? fallback : dict[fallback];
+      queue[tail++] = child;
+    }
+  }
+  automaton->next = (uint32_t *)malloc(sizeof(uint32_t) * nstates * nclasses);
+  if (automaton->next == NULL)
+    exit(1);
+  for (long i = 0; i < (long)nstates * nclasses; i++) {
+    int state = trie[i];
+    automaton->next[i] = state * nclasses;
+    if (out[state] >= 0 || dict[state] >= 0)
+      automaton->next[i] |= OUTPUT_FLAG;
+  }
+  automaton->out = out;
+  automaton->dict = dict;
+  free(queue);
+  free(fail);
+  free(trie);
+  return automaton;
+}
+
+void automaton_destroy(Automaton *automaton) {
+  free(automaton->next);
+  free(automaton->out);
+  free(automaton->dict);
+  free(automaton->same);
+  free(automaton);
+}
+
+// writes the number of lines each pattern was found on to stderr.
+void print_counts(Automaton *automaton, long *counts) {
+  for (int i = 0; i < automaton->npatterns; i++)
+    fprintf(stderr, "%ld %s\n", counts[automaton->same[i]],
+            automaton->patterns[i]);
+}
+
+/*
+ * Finds the first copy of term in [begin, end), or returns NULL.
+ *
+ * Candidates are found 16 positions at a time by comparing both the first and
+ * the last byte of term, which rules out almost every position before a
+ * memcmp is needed.
+ */
+char *find_term(char *begin, char *end, char *term, size_t length) {
+  if (length == 0)
+    return begin;
+  if (length == 1)
+    return memchr(begin, *term, end - begin);
+#ifdef __SSE2__
+  __m128i first = _mm_set1_epi8(term[0]);
+  __m128i last = _mm_set1_epi8(term[length - 1]);
+  for (; end - begin >= (long)length + 15; begin += 16) {
+    __m128i block_first = _mm_loadu_si128((__m128i *)begin);
+    __m128i block_last = _mm_loadu_si128((__m128i *)(begin + length - 1));
+    unsigned int mask = _mm_movemask_epi8(_mm_and_si128(
+        _mm_cmpeq_epi8(block_first, first), _mm_cmpeq_epi8(block_last, last)));
+    for (; mask; mask &= mask - 1) {
+      char *found = begin + __builtin_ctz(mask);
+      if (!memcmp(found + 1, term + 1, length - 2))
+        return found;
+    }
+  }
+#endif
+  while (end - begin >= (long)length) {
+    begin = memchr(begin, *term, end - begin - length + 1);
+    if (begin == NULL)
+      return NULL;
+    if (!memcmp(begin + 1, term + 1, length - 1))
+      return begin;
+    begin++;
+  }
+  return NULL;
+}
+
+void write_matches(Matches *matches) {
+  for (int i = 0; i < matches->length; i++)
+    fwrite(matches->ranges[i].begin, 1, matches->ranges[i].length,
+           matches->out);
+  matches->length = 0;
+}
+
+// adds the line [begin, end) to matches.
+void add_match(Matches *matches, char *begin, char *end) {
+  if (matches->length > 0) {
+    Range *last = matches->ranges + matches->length - 1;
+    if (last->begin + last->length == begin) {
+      last->length += end - begin;
+      return;
+    }
+  }
+  if (matches->flush && matches->length == FLUSH_RANGES)
+    write_matches(matches);
+  if (matches->length == matches->capacity) {
+    matches->capacity = matches->capacity ? matches->capacity * 2 : 64;
+    matches->ranges = (Range *)realloc(matches->ranges,
+                                       sizeof(Range) * matches->capacity);
+    if (matches->ranges == NULL)
+      exit(1);
+  }
+  matches->ranges[matches->length].begin = begin;
+  matches->ranges[matches->length].length = end - begin;
+  matches->length++;
+}
+
+void matches_init(Matches *matches, Query *query, FILE *out, int flush) {
+  memset(matches, 0, sizeof(Matches));
+  matches->out = out;
+  matches->flush = flush;
+  if (query->automaton) {
+    int npatterns = query->automaton->npatterns;
+    matches->counts = (long *)calloc(npatterns, sizeof(long));
+    matches->counted_line = (char **)calloc(npatterns, sizeof(char *));
+    if (matches->counts == NULL || matches->counted_line == NULL)
+      exit(1);
   }
 }
 
-int match(char *search, char *string) {
-  for (int loc = 0; string[loc] != '\0'; loc++) {
-    // printf("examined: %c\n", string[loc]);
-    int ploc = loc;
-    for (int sloc = 0;; sloc++) {
-      if (search[sloc] == '\0') {
-        return loc;
-      } else if (search[sloc] != string[ploc++]) {
-        break;
+// writes out matches, adding its counts to counts.
+void matches_finish(Matches *matches, Query *query, long *counts) {
+  write_matches(matches);
+  if (query->automaton)
+    for (int i = 0; i < query->automaton->npatterns; i++)
+      counts[i] += matches->counts[i];
+  free(matches->ranges);
+  free(matches->counts);
+  free(matches->counted_line);
+}
+
+/*
+ * Adds every line of [begin, end) holding term to matches. The whole range is
+ * searched at once, and lines are only found around each hit. end must be the
+ * end of a line, or of the input.
+ */
+void search_term(char *begin, char *end, char *term, size_t length,
+                 Matches *matches) {
+  // A line ends at its newline, so a newline before the end of term never
+  // matches.
+  if (length > 1 && memchr(term, '\n', length - 1))
+    return;
+  while (begin < end) {
+    char *found = find_term(begin, end, term, length);
+    if (found == NULL)
+      return;
+    char *line = memrchr(begin, '\n', found - begin);
+    line = line ? line + 1 : begin;
+    // term may end with the newline that ends its line.
+    char *last = length > 0 ? found + length - 1 : found;
+    char *line_end = memchr(last, '\n', end - last);
+    line_end = line_end ? line_end + 1 : end;
+    add_match(matches, line, line_end);
+    begin = line_end;
+  }
+}
+
+/*
+ * Adds every line of [begin, end) holding any of the patterns to matches, and
+ * counts the lines each pattern is on. The automaton runs over the whole
+ * range, and lines are only found around each hit. begin must be the start
+ * of a line, and end the end of one, or of the input.
+ */
+void search_patterns(char *begin, char *end, Automaton *automaton,
+                     Matches *matches) {
+  // Ranges searched before may have been in the same memory.
+  memset(matches->counted_line, 0, sizeof(char *) * automaton->npatterns);
+  if (automaton->empty >= 0 && begin < end) {
+    add_match(matches, begin, end);
+    long lines = end[-1] != '\n';
+    for (char *c = begin; (c = memchr(c, '\n', end - c)); c++)
+      lines++;
+    matches->counts[automaton->empty] += lines;
+  }
+  char *line = begin, *line_end = begin; // The line of the last hit.
+  uint32_t *next = automaton->next;
+  unsigned short *classes = automaton->classes;
+  uint32_t row = 0;
+  for (char *c = begin; c < end; c++) {
+    uint32_t edge = next[row + classes[(unsigned char)*c]];
+    row = edge & ~OUTPUT_FLAG;
+    if (!(edge & OUTPUT_FLAG))
+      continue;
+    if (c >= line_end) {
+      line = memrchr(begin, '\n', c - begin);
+      line = line ? line + 1 : begin;
+      line_end = memchr(c, '\n', end - c);
+      line_end = line_end ? line_end + 1 : end;
+      if (automaton->empty < 0)
+        add_match(matches, line, line_end);
+    }
+    int state = row / automaton->nclasses;
+    if (automaton->out[state] < 0)
+      state = automaton->dict[state];
+    for (; state >= 0; state = automaton->dict[state]) {
+      int pattern = automaton->out[state];
+      if (matches->counted_line[pattern] != line) {
+        matches->counted_line[pattern] = line;
+        matches->counts[pattern]++;
       }
     }
   }
-  return -1;
 }
 
-int search_file(char *filename, char *search_term) {
-  FILE *fp = NULL;
+void search_range(char *begin, char *end, Query *query, Matches *matches) {
+  if (query->automaton)
+    search_patterns(begin, end, query->automaton, matches);
+  else
+    search_term(begin, end, query->term, query->term_length, matches);
+}
+
+void *search_section(Section *section) {
+  search_range(section->begin, section->end, section->query,
+               &section->matches);
+  return NULL;
+}
+
+/*
+ * Searches a whole mapped file, split across threads if it is large enough,
+ * and writes the matching lines in order.
+ */
+void search_mapped(char *file, size_t file_length, Query *query,
+                   Results *results) {
+  long nthreads = results->split;
+  if (nthreads > (long)file_length / MIN_THREAD_BYTES)
+    nthreads = file_length / MIN_THREAD_BYTES;
+  if (nthreads < 1)
+    nthreads = 1;
+  Section *sections = (Section *)calloc(nthreads, sizeof(Section));
+  if (sections == NULL)
+    exit(1);
+  char *end = file + file_length;
+  char *begin = file;
+  for (long i = 0; i < nthreads; i++) {
+    // Each section ends after the newline following its share of the file.
+    char *section_end = end;
+    if (i < nthreads - 1) {
+      section_end = file + file_length / nthreads * (i + 1);
+      if (section_end < begin)
+        section_end = begin;
+      section_end = memchr(section_end, '\n', end - section_end);
+      section_end = section_end ? section_end + 1 : end;
+    }
+    sections[i].begin = begin;
+    sections[i].end = section_end;
+    sections[i].query = query;
+    matches_init(&sections[i].matches, query, results->out, nthreads == 1);
+    begin = section_end;
+  }
+  if (nthreads == 1) {
+    search_section(sections);
+  } else {
+    for (long i = 0; i < nthreads; i++)
+      if (pthread_create(&sections[i].thread, NULL,
+                         (void *(*)(void *))search_section, sections + i))
+        exit(1);
+    for (long i = 0; i < nthreads; i++)
+      pthread_join(sections[i].thread, NULL);
+  }
+  for (long i = 0; i < nthreads; i++)
+    matches_finish(&sections[i].matches, query, results->counts);
+  free(sections);
+}
+
+/*
+ * Searches a pipe or terminal a buffer at a time. Only whole lines are
+ * searched, the partial line at the end of a buffer is kept for the next.
+ */
+void search_stream(int fd, Query *query, Results *results) {
+  size_t capacity = STREAM_BUFF_SIZE, length = 0;
+  char *buff = (char *)malloc(capacity);
+  if (buff == NULL)
+    exit(1);
+  Matches matches;
+  matches_init(&matches, query, results->out, 1);
+  while (1) {
+    if (length == capacity) {
+      // A line longer than the buffer.
+      capacity *= 2;
+      if ((buff = (char *)realloc(buff, capacity)) == NULL)
+        exit(1);
+    }
+    ssize_t got = read(fd, buff + length, capacity - length);
+    if (got <= 0) {
+      search_range(buff, buff + length, query, &matches);
+      break;
+    }
+    char *last_newline = memrchr(buff + length, '\n', got);
+    length += got;
+    if (last_newline == NULL)
+      continue;
+    char *lines_end = last_newline + 1;
+    search_range(buff, lines_end, query, &matches);
+    write_matches(&matches);
+    length = buff + length - lines_end;
+    memmove(buff, lines_end, length);
+  }
+  matches_finish(&matches, query, results->counts);
+  free(buff);
+}
+
+int search_file(char *filename, Query *query, Results *results) {
+  int fd = STDIN_FILENO;
   if (filename != NULL) {
-    fp = fopen(filename, "r");
-    if (fp == NULL) {
-      printf("wgrep: cannot open file\n");
+    fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+      fprintf(results->out, "wgrep: cannot open file\n");
       return 1;
     }
   }
-  char *line = NULL;
-  size_t linecap = 0;
-  ssize_t linelen = 0;
-  while ((linelen = getline(&line, &linecap, filename == NULL ? stdin : fp)) >
-         0) {
-    if (match(search_term, line) >= 0)
-      fwrite(line, linelen, 1, stdout);
-  }
-  if (line != NULL)
-    free(line);
-  fclose(fp);
+  struct stat sb;
+  char *file = MAP_FAILED;
+  // stdin may be a file that has been read from already.
+  if (fstat(fd, &sb) != -1 && S_ISREG(sb.st_mode) && sb.st_size > 0 &&
+      lseek(fd, 0, SEEK_CUR) == 0)
+    file = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (file != MAP_FAILED) {
+    madvise(file, sb.st_size, MADV_SEQUENTIAL);
+    search_mapped(file, sb.st_size, query, results);
+    munmap(file, sb.st_size);
+  } else {
+    search_stream(fd, query, results);
+  }
+  if (fd != STDIN_FILENO)
+    close(fd);
   return 0;
 }
+
+void *search_pool_files(FileWorker *worker) {
+  FilePool *pool = worker->pool;
+  pthread_mutex_lock(&pool->guard);
+  while (pool->next < pool->nfiles) {
+    int file = pool->next;
+    if (pool->ordered &&
+        file >= pool->written + pool->nthreads * FILES_PER_THREAD) {
+      pthread_cond_wait(&pool->emptied, &pool->guard);
+      continue;
+    }
+    pool->next++;
+    pthread_mutex_unlock(&pool->guard);
+    char *out = NULL;
+    size_t out_length = 0;
+    if (pool->ordered && (worker->results.out = open_memstream(
+                              &out, &out_length)) == NULL)
+      exit(1);
+    int failed = search_file(pool->files[file], pool->query, &worker->results);
+    if (pool->ordered)
+      fclose(worker->results.out);
+    pthread_mutex_lock(&pool->guard);
+    pool->failed |= failed;
+    pool->outs[file] = out;
+    pool->out_lengths[file] = out_length;
+    pool->done[file] = 1;
+    pthread_cond_signal(&pool->searched);
+  }
+  pthread_mutex_unlock(&pool->guard);
+  return NULL;
+}
+
+/*
+ * Searches files with a pool of nthreads threads, each searching a whole file
+ * at a time. If ordered, the lines are written in the order of files, else
+ * as they are found. Returns 1 if any file could not be opened.
+ */
+int search_files(char **files, int nfiles, Query *query, int nthreads,
+                 int ordered, long *counts) {
+  if (nthreads > nfiles)
+    nthreads = nfiles;
+  FilePool pool = {.files = files,
+                   .nfiles = nfiles,
+                   .query = query,
+                   .ordered = ordered,
+                   .nthreads = nthreads,
+                   .next = 0,
+                   .written = 0,
+                   .outs = (char **)calloc(nfiles, sizeof(char *)),
+                   .out_lengths = (size_t *)calloc(nfiles, sizeof(size_t)),
+                   .done = (int *)calloc(nfiles, sizeof(int)),
+                   .failed = 0};
+  FileWorker *workers = (FileWorker *)calloc(nthreads, sizeof(FileWorker));
+  if (!pool.outs || !pool.out_lengths || !pool.done || !workers)
+    exit(1);
+  pthread_mutex_init(&pool.guard, NULL);
+  pthread_cond_init(&pool.searched, NULL);
+  pthread_cond_init(&pool.emptied, NULL);
+  int npatterns = query->automaton ? query->automaton->npatterns : 0;
+  for (int i = 0; i < nthreads; i++) {
+    workers[i].pool = &pool;
+    workers[i].results.out = stdout;
+    workers[i].results.counts =
+        npatterns ? (long *)calloc(npatterns, sizeof(long)) : NULL;
+    if (pthread_create(&workers[i].thread, NULL,
+                       (void *(*)(void *))search_pool_files, workers + i))
+      exit(1);
+  }
+  if (ordered) {
+    pthread_mutex_lock(&pool.guard);
+    while (pool.written < nfiles) {
+      int file = pool.written;
+      while (!pool.done[file])
+        pthread_cond_wait(&pool.searched, &pool.guard);
+      pthread_mutex_unlock(&pool.guard);
+      fwrite(pool.outs[file], 1, pool.out_lengths[file], stdout);
+      free(pool.outs[file]);
+      pthread_mutex_lock(&pool.guard);
+      pool.written++;
+      pthread_cond_broadcast(&pool.emptied);
+    }
+    pthread_mutex_unlock(&pool.guard);
+  }
+  for (int i = 0; i < nthreads; i++) {
+    pthread_join(workers[i].thread, NULL);
+    for (int j = 0; j < npatterns; j++)
+      counts[j] += workers[i].results.counts[j];
+    free(workers[i].results.counts);
+  }
+  pthread_mutex_destroy(&pool.guard);
+  pthread_cond_destroy(&pool.searched);
+  pthread_cond_destroy(&pool.emptied);
+  free(pool.outs);
+  free(pool.out_lengths);
+  free(pool.done);
+  free(workers);
+  return pool.failed;
+}
@@ -1,15 +1,240 @@
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
-int read_compressed_char(FILE *from, FILE *to) {
-  int count;
-  fread(&count, 4, 1, from);
-  char c;
-  int out = fread(&c, 1, 1, from);
-  while (count-- > 0) {
-    putc(c, to);
+const char COMPACT_MAGIC[] = "PZC1"; // Starts input in the compact format.
+const char FRAMED_MAGIC[] = "PZF1";  // Starts pzip's framed format, which
+                                     // only punzip reads.
+const int MAX_VARINT_SIZE = 10;
+const size_t OUTPUT_SIZE = 1 << 22;  // Output is written this much at a time.
+const size_t BLOCK_SIZE = 1 << 20;   // Files that can not be mapped are read
+                                     // this much at a time.
+const size_t PATTERN_SIZE = 1 << 16; // Runs at least this long are written
+                                     // from a page of the char, not copied.
+const int PATTERN_IOV = 64;          // The copies of the page in one writev.
+
+/*
+ * Output is gathered here and written with one call once the buffer is full,
+ * rather than a stdio call per char.
+ */
+typedef struct {
+  char *buff;
+  size_t length;
+} Output;
+
+void output_flush(Output *to) {
+  for (size_t written = 0; written < to->length;) {
+    ssize_t put = write(STDOUT_FILENO, to->buff + written, to->length - written);
+    if (put < 0 && errno != EINTR)
+      exit(1);
+    if (put > 0)
+      written += put;
+  }
+  to->length = 0;
+}
+
+void output_write(Output *to, const char *data, size_t length) {
+  while (length > 0) {
+    if (to->length == OUTPUT_SIZE)
+      output_flush(to);
+    size_t part = OUTPUT_SIZE - to->length < length ? OUTPUT_SIZE - to->length
+                                                    : length;
+    memcpy(to->buff + to->length, data, part);
+    to->length += part;
+    data += part;
+    length -= part;
+  }
+}
+
+/*
+ * Writes a long run straight from a page filled with c, handing the kernel the
+ * same page many times over in each writev.
+ */
+void write_pattern(char c, unsigned long count) {
+  static char *page = NULL;
+  static int page_char = -1;
+  if (page == NULL && (page = (char *)malloc(PATTERN_SIZE)) == NULL)
+    exit(1);
+  if (page_char != (unsigned char)c) {
+    memset(page, c, PATTERN_SIZE);
+    page_char = (unsigned char)c;
+  }
+  struct iovec iov[PATTERN_IOV];
+  while (count > 0) {
+    int iovcnt = 0;
+    ssize_t length = 0;
+    for (; iovcnt < PATTERN_IOV && (unsigned long)length < count; iovcnt++) {
+      iov[iovcnt].iov_base = page;
+      iov[iovcnt].iov_len = count - length < PATTERN_SIZE ? count - length
+                                                          : PATTERN_SIZE;
+      length += iov[iovcnt].iov_len;
+    }
+    ssize_t put = writev(STDOUT_FILENO, iov, iovcnt);
+    if (put < 0 && errno != EINTR)
+      exit(1);
+    if (put > 0)
+      count -= put;
+  }
+}
+
+void write_run(Output *to, char c, unsigned long count) {
+  if (count >= PATTERN_SIZE) {
+    output_flush(to);
+    write_pattern(c, count);
+    return;
+  }
+  while (count > 0) {
+    if (to->length == OUTPUT_SIZE)
+      output_flush(to);
+    size_t part = OUTPUT_SIZE - to->length < count ? OUTPUT_SIZE - to->length
+                                                   : count;
+    memset(to->buff + to->length, c, part);
+    to->length += part;
+    count -= part;
+  }
+}
+
+typedef struct {
+  int compact;           // Set if reading the compact format.
+  unsigned long literal; // The bytes of a literal token still to copy.
+} Decoder;
+
+// reads a varint written 7 bits at a time, low bits first, from
+// [begin, end), returning the number of bytes read, or 0 if it does not end
+// in time.
+int read_varint(unsigned char *begin, unsigned char *end,
+                unsigned long *value) {
+  *value = 0;
+  for (int size = 0; size < MAX_VARINT_SIZE && begin + size < end; size++) {
+    *value |= (unsigned long)(begin[size] & 0x7F) << (7 * size);
+    if (!(begin[size] & 0x80))
+      return size + 1;
+  }
+  return 0;
+}
+
+/*
+ * Decodes every whole record in [begin, end), returning where the first
+ * record that does not fit starts.
+ */
+char *decode_records(char *begin, char *end, Output *to) {
+  for (; end - begin >= 5; begin += 5) {
+    int count;
+    memcpy(&count, begin, 4);
+    if (count > 0)
+      write_run(to, begin[4], count);
+  }
+  return begin;
+}
+
+/*
+ * Decodes the tokens of the compact format in [begin, end): an even header
+ * is followed by a char to repeat header / 2 times, an odd one by header / 2
+ * literal bytes. A literal may go on past end, the rest of it is kept in
+ * decoder. Returns where the first token that does not fit starts.
+ */
+char *decode_tokens(char *begin, char *end, Decoder *decoder, Output *to) {
+  while (begin < end) {
+    if (decoder->literal > 0) {
+      size_t part = (unsigned long)(end - begin) < decoder->literal
+                        ? (size_t)(end - begin)
+                        : decoder->literal;
+      output_write(to, begin, part);
+      decoder->literal -= part;
+      begin += part;
+      continue;
+    }
+    unsigned long header;
+    int size = read_varint((unsigned char *)begin, (unsigned char *)end,
+                           &header);
+    if (size == 0 || (!(header & 1) && begin + size == end))
+      break;
+    begin += size;
+    if (header & 1) {
+      decoder->literal = header >> 1;
+    } else {
+      write_run(to, *begin, header >> 1);
+      begin++;
+    }
+  }
+  return begin;
+}
+
+char *decode_block(char *begin, char *end, Decoder *decoder, Output *to) {
+  if (decoder->compact)
+    return decode_tokens(begin, end, decoder, to);
+  return decode_records(begin, end, to);
+}
+
+/*
+ * Decompresses the file open on fd, mapping it if it is a regular file and
+ * reading it in blocks if not. Returns 0 if successful, 1 if it can not be
+ * read, 2 if it ends part way through a record, or 3 if it is in the framed
+ * format.
+ */
+int decompress_file(int fd, Output *to) {
+  Decoder decoder = {0, 0};
+  struct stat sb;
+  if (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_size > 0) {
+    char *file = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (file != MAP_FAILED) {
+      madvise(file, sb.st_size, MADV_SEQUENTIAL);
+      char *begin = file, *end = file + sb.st_size;
+      if (sb.st_size >= 4 && !memcmp(file, FRAMED_MAGIC, 4)) {
+        munmap(file, sb.st_size);
+        return 3;
+      }
+      if (sb.st_size >= 4 && !memcmp(file, COMPACT_MAGIC, 4)) {
+        decoder.compact = 1;
+        begin += 4;
+      }
+      begin = decode_block(begin, end, &decoder, to);
+      munmap(file, sb.st_size);
+      return begin < end || decoder.literal > 0 ? 2 : 0;
+    }
+  }
+  char *buff = (char *)malloc(BLOCK_SIZE);
+  if (buff == NULL)
+    return 1;
+  size_t length = 0; // Bytes read but not decoded yet.
+  int started = 0;   // Set once the format is known.
+  ssize_t got;
+  while ((got = read(fd, buff + length, BLOCK_SIZE - length)) != 0) {
+    if (got < 0 && errno == EINTR)
+      continue;
+    if (got < 0)
+      break;
+    length += got;
+    char *begin = buff;
+    // The first 4 bytes are the magic of the compact format, or the count
+    // of the first record.
+    if (!started) {
+      if (length < 4)
+        continue;
+      started = 1;
+      if (!memcmp(buff, FRAMED_MAGIC, 4)) {
+        free(buff);
+        return 3;
+      }
+      if (!memcmp(buff, COMPACT_MAGIC, 4)) {
+        decoder.compact = 1;
+        begin += 4;
+      }
+    }
+    begin = decode_block(begin, buff + length, &decoder, to);
+    length = buff + length - begin;
+    memmove(buff, begin, length);
   }
-  return out;
+  free(buff);
+  if (got < 0)
+    return 1;
+  return length > 0 || decoder.literal > 0 ? 2 : 0;
 }
 
 int main(int argc, char **argv) {
@@ -17,13 +242,24 @@ int main(int argc, char **argv) {
     printf("wunzip: file1 [file2 ...]\n");
     return 1;
   } else {
+    Output out = {(char *)malloc(OUTPUT_SIZE), 0};
+    if (out.buff == NULL)
+      return 1;
     for (int i = 1; i < argc; i++) {
-      FILE *fp = fopen(argv[i], "r");
-      if (fp == NULL)
+      int fd = open(argv[i], O_RDONLY);
+      int result = fd == -1 ? 1 : decompress_file(fd, &out);
+      if (fd != -1)
+        close(fd);
+      if (result) {
+        output_flush(&out);
+        if (result == 2)
+          fprintf(stderr, "wunzip: truncated record\n");
+        if (result == 3)
+          fprintf(stderr, "wunzip: framed input, use punzip\n");
         return 1;
-      while (read_compressed_char(fp, stdout)) {
       }
-      fclose(fp);
     }
+    output_flush(&out);
+    free(out.buff);
   }
 }
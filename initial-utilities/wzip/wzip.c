@@ -1,10 +1,64 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-void write_compressed_char(FILE *to, char c, int *count) {
+const char USAGE[] = "wzip: [-c] file1 [file2 ...]\n";
+const char COMPACT_MAGIC[] = "PZC1"; // Starts output in the compact format.
+const int COMPACT_MIN_RUN = 3;       // Shorter runs are cheaper as literals.
+const int LITERAL_LENGTH = 1 << 12;  // The longest literal written at once.
+const size_t OUTPUT_SIZE = 1 << 22;  // Output is written this much at a time.
+const size_t BLOCK_SIZE = 1 << 20;   // Files that can not be mapped are read
+                                     // this much at a time.
+
+/*
+ * Output is gathered here and written with one call once the buffer is full,
+ * rather than a stdio call per record.
+ */
+typedef struct {
+  char *buff;
+  size_t length;
+} Output;
+
+void output_flush(Output *to) {
+  for (size_t written = 0; written < to->length;) {
+    ssize_t put = write(STDOUT_FILENO, to->buff + written, to->length - written);
+    if (put < 0 && errno != EINTR)
+      exit(1);
+    if (put > 0)
+      written += put;
+  }
+  to->length = 0;
+}
+
+void output_write(Output *to, const void *data, size_t length) {
+  if (to->length + length > OUTPUT_SIZE)
+    output_flush(to);
+  memcpy(to->buff + to->length, data, length);
+  to->length += length;
+}
+
+void output_putc(Output *to, char c) {
+  if (to->length == OUTPUT_SIZE)
+    output_flush(to);
+  to->buff[to->length++] = c;
+}
+
+void write_compressed_char(Output *to, char c, int *count) {
   if (*count > 0) {
-    fwrite(count, 4, 1, to);
-    putc(c, to);
+    char record[5];
+    memcpy(record, count, 4);
+    record[4] = c;
+    output_write(to, record, 5);
     *count = 0;
   }
 }
@@ -12,36 +66,184 @@ void write_compressed_char(FILE *to, char c, int *count) {
 typedef struct {
   char last_char;
   int count;
+  int compact;        // Set if writing the compact format.
+  char *literal;      // Short runs not written yet, in the compact format.
+  int literal_length;
 } CompressInfo;
 
-void write_compressed_file(FILE *old_file, FILE *to, CompressInfo *info) {
-  char c;
-  while ((c = getc(old_file)) != EOF) {
-    if (c == info->last_char) {
-      (info->count)++;
-    } else {
-      write_compressed_char(to, info->last_char, &(info->count));
-      info->last_char = c;
-      info->count = 1;
+// writes value 7 bits at a time, low bits first.
+void write_varint(Output *to, unsigned long value) {
+  for (; value >= 0x80; value >>= 7)
+    output_putc(to, (value & 0x7F) | 0x80);
+  output_putc(to, value);
+}
+
+void write_literal(Output *to, CompressInfo *info) {
+  if (info->literal_length > 0) {
+    write_varint(to, (unsigned long)info->literal_length << 1 | 1);
+    output_write(to, info->literal, info->literal_length);
+    info->literal_length = 0;
+  }
+}
+
+/*
+ * Writes the run in info as a token, or adds it to the literal if it is too
+ * short for one.
+ */
+void write_compact_run(Output *to, CompressInfo *info) {
+  if (info->count >= COMPACT_MIN_RUN) {
+    write_literal(to, info);
+    write_varint(to, (unsigned long)info->count << 1);
+    output_putc(to, info->last_char);
+  } else {
+    for (int i = 0; i < info->count; i++) {
+      if (info->literal_length == LITERAL_LENGTH)
+        write_literal(to, info);
+      info->literal[info->literal_length++] = info->last_char;
+    }
+  }
+  info->count = 0;
+}
+
+void write_run(Output *to, CompressInfo *info) {
+  if (info->compact)
+    write_compact_run(to, info);
+  else
+    write_compressed_char(to, info->last_char, &(info->count));
+}
+
+/*
+ * Returns the end of the run of c that starts at begin, comparing 16 bytes
+ * at a time, or a word at a time without SSE2.
+ */
+char *scan_run(char *begin, char *end, char c) {
+#ifdef __SSE2__
+  __m128i pattern = _mm_set1_epi8(c);
+  for (; end - begin >= 16; begin += 16) {
+    __m128i block = _mm_loadu_si128((__m128i *)begin);
+    unsigned int differ =
+        _mm_movemask_epi8(_mm_cmpeq_epi8(block, pattern)) ^ 0xFFFF;
+    if (differ)
+      return begin + __builtin_ctz(differ);
+  }
+#elif __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  uint64_t pattern = 0x0101010101010101ULL * (unsigned char)c;
+  for (; end - begin >= 8; begin += 8) {
+    uint64_t word;
+    memcpy(&word, begin, 8);
+    if (word != pattern)
+      return begin + __builtin_ctzll(word ^ pattern) / 8;
+  }
+#endif
+  while (begin < end && *begin == c)
+    begin++;
+  return begin;
+}
+
+/*
+ * Adds the runs of [begin, end) to info, writing every run that is finished.
+ * The last run is kept in info, so it can carry on into the next block or
+ * file.
+ */
+void write_compressed_block(char *begin, char *end, Output *to,
+                            CompressInfo *info) {
+  while (begin < end) {
+    char c = *begin;
+    char *run_end = begin + 1;
+    // Most runs in text are a single char, so check before calling out.
+    if (run_end < end && *run_end == c)
+      run_end = scan_run(run_end, end, c);
+    if (info->count > 0 && c != info->last_char)
+      write_run(to, info);
+    info->last_char = c;
+    size_t count = run_end - begin;
+    // A record only has room for INT_MAX.
+    while (count > (size_t)(INT_MAX - info->count)) {
+      count -= INT_MAX - info->count;
+      info->count = INT_MAX;
+      write_run(to, info);
     }
+    info->count += count;
+    begin = run_end;
   }
 }
 
+/*
+ * Compresses the file open on fd, mapping it if it is a regular file and
+ * reading it in blocks if not. Returns 0 if successful.
+ */
+int write_compressed_file(int fd, Output *to, CompressInfo *info) {
+  struct stat sb;
+  if (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_size > 0) {
+    char *file = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (file != MAP_FAILED) {
+      madvise(file, sb.st_size, MADV_SEQUENTIAL);
+      write_compressed_block(file, file + sb.st_size, to, info);
+      munmap(file, sb.st_size);
+      return 0;
+    }
+  }
+  char *block = (char *)malloc(BLOCK_SIZE);
+  if (block == NULL)
+    return 1;
+  ssize_t got;
+  while ((got = read(fd, block, BLOCK_SIZE)) != 0) {
+    if (got < 0 && errno == EINTR)
+      continue;
+    if (got < 0)
+      break;
+    write_compressed_block(block, block + got, to, info);
+  }
+  free(block);
+  return got < 0;
+}
+
 int main(int argc, char **argv) {
-  if (argc == 1) {
-    printf("wzip: file1 [file2 ...]\n");
+  CompressInfo info;
+  info.last_char = EOF;
+  info.count = 0;
+  info.compact = 0;
+  info.literal_length = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "c")) != -1) {
+    if (opt != 'c') {
+      fputs(USAGE, stdout);
+      return 1;
+    }
+    info.compact = 1;
+  }
+  if (optind == argc) {
+    fputs(USAGE, stdout);
     return 1;
   } else {
-    CompressInfo info;
-    info.last_char = EOF;
-    info.count = 0;
-    for (int i = 1; i < argc; i++) {
-      FILE *fp = fopen(argv[i], "r");
-      if (fp == NULL)
+    Output out = {(char *)malloc(OUTPUT_SIZE), 0};
+    if (out.buff == NULL)
+      return 1;
+    if (info.compact) {
+      info.literal = (char *)malloc(LITERAL_LENGTH);
+      if (info.literal == NULL)
         return 1;
-      write_compressed_file(fp, stdout, &info);
-      fclose(fp);
+      output_write(&out, COMPACT_MAGIC, 4);
+    }
+    for (int i = optind; i < argc; i++) {
+      int fd = open(argv[i], O_RDONLY);
+      if (fd == -1) {
+        output_flush(&out);
+        return 1;
+      }
+      int failed = write_compressed_file(fd, &out, &info);
+      close(fd);
+      if (failed) {
+        output_flush(&out);
+        return 1;
+      }
+    }
+    write_run(&out, &info);
+    if (info.compact) {
+      write_literal(&out, &info);
+      free(info.literal);
     }
-    write_compressed_char(stdout, info.last_char, &(info.count));
+    output_flush(&out);
+    free(out.buff);
   }
 }